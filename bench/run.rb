@@ -0,0 +1,133 @@
+# the workloads of rake bench, prints one JSON object per line so runs can be diffed across releases
+# run with: mruby bench/run.rb [conninfo] [scan rows] [ops]
+conn = Pq.new(ARGV[0] || "postgresql://localhost/postgres")
+SCAN_ROWS = (ARGV[1] || 1_000_000).to_i
+OPS = (ARGV[2] || 20_000).to_i
+WIDE_ROWS = 10_000
+ITEMS = 100_000
+
+def json(pairs)
+  "{" + pairs.map do |key, value|
+    value = case value
+            when Float then format("%.3f", value)
+            when String then value.inspect
+            else value.to_s
+            end
+    "#{key.to_s.inspect}:#{value}"
+  end.join(",") + "}"
+end
+
+# exec returns error results instead of raising, a failing workload would otherwise time its error path
+def check(res)
+  raise res if res.is_a?(Pq::Result::Error)
+  res
+end
+
+def live_objects
+  counts = ObjectSpace.count_objects
+  counts[:TOTAL] - counts[:FREE]
+end
+
+# objects created while the block runs, the GC is off so nothing is freed in between
+def allocations
+  GC.start
+  GC.disable
+  before = live_objects
+  yield
+  live_objects - before
+ensure
+  GC.enable
+end
+
+# runs the block ops times, then once more with the GC off to count its allocations
+def measure(name, ops:, rows:, **extra)
+  yield # warm up
+  started = Time.now
+  ops.times { yield }
+  elapsed = Time.now - started
+  allocated = allocations { yield }
+  puts json({bench: name, ops: ops, rows_per_op: rows, seconds: elapsed.to_f,
+    ops_per_s: ops / elapsed.to_f, rows_per_s: ops * rows / elapsed.to_f,
+    allocs_per_op: allocated, allocs_per_row: allocated / rows.to_f}.merge(extra))
+end
+
+check(conn.exec("set client_min_messages to warning"))
+check(conn.exec("drop table if exists bench_items, bench_scan, bench_insert"))
+check(conn.exec("create table bench_items (id int8 primary key, name text not null, price float8 not null, created timestamptz not null)"))
+check(conn.exec("insert into bench_items select g, 'item ' || g, g * 0.25, timestamptz '2020-01-01 00:00:00+00' + g * interval '1 minute' from generate_series(1, $1::int) g", ITEMS))
+check(conn.exec("create table bench_scan as select g::int8 as id, 'row ' || g as name, g * 0.5 as value from generate_series(1, $1::int) g", SCAN_ROWS))
+check(conn.exec("create table bench_insert (id int8, name text, price float8, active bool, created timestamptz, note text, tags text[], score int4)"))
+check(conn.exec("vacuum analyze"))
+
+server = conn.exec("select current_setting('server_version')").getvalue(0, 0)
+puts json({bench: "meta", mruby: MRUBY_VERSION, server: server, chunked_rows: Pq::CHUNKED_ROWS, scan_rows: SCAN_ROWS, ops: OPS})
+
+# point selects, unprepared, prepared by hand and through the statement cache
+point = "select id, name, price, created from bench_items where id = $1"
+random = Random.new(42)
+measure("point_select_exec", ops: OPS, rows: 1) { check(conn.exec(point, random.rand(ITEMS) + 1)).values }
+statement = conn.prepare("bench_point", point)
+random = Random.new(42)
+measure("point_select_prepared", ops: OPS, rows: 1) { check(statement.exec(random.rand(ITEMS) + 1)).values }
+conn.statement_cache = 16
+random = Random.new(42)
+measure("point_select_cached", ops: OPS, rows: 1) { check(conn.exec(point, random.rand(ITEMS) + 1)).values }
+conn.statement_cache = nil
+
+# whole table scans
+scan = "select id, name, value from bench_scan"
+measure("scan_buffered", ops: 3, rows: SCAN_ROWS) { check(conn.exec(scan)).to_ary }
+conn.with_result_format(Pq::BINARY) do
+  measure("scan_buffered_binary", ops: 3, rows: SCAN_ROWS) { check(conn.exec(scan)).to_ary }
+end
+measure("scan_single_row", ops: 3, rows: SCAN_ROWS) { conn.stream(scan) { |row| row } }
+conn.chunk_size = 1000
+measure("scan_chunked", ops: 3, rows: SCAN_ROWS, chunk_size: 1000) { conn.stream(scan) { |row| row } }
+conn.chunk_size = 1
+
+# decoding ten columns of a single type, the result is fetched once so only the decoding is timed
+{
+  "bool" => "g % 2 = 0",
+  "int4" => "g::int4",
+  "int8" => "g::int8 * 1000003",
+  "float8" => "g * 1.5::float8",
+  "numeric" => "(g * 1.25)::numeric(12, 2)",
+  "text" => "'value ' || g",
+  "bytea" => "decode(md5(g::text), 'hex')",
+  "uuid" => "md5(g::text)::uuid",
+  "date" => "date '2000-01-01' + g % 10000",
+  "timestamptz" => "timestamptz '2000-01-01 00:00:00+00' + g * interval '1 second'",
+  "interval" => "g * interval '1 second'",
+  "jsonb" => "jsonb_build_object('id', g, 'name', 'item ' || g)",
+  "int4[]" => "array[g, g + 1, g + 2]"
+}.each do |type, expr|
+  query = "select #{(["v"] * 10).join(", ")} from (select #{expr} as v from generate_series(1, #{WIDE_ROWS}) g) s"
+  [Pq::TEXT, Pq::BINARY].each do |format|
+    res = check(conn.with_result_format(format) { conn.exec(query) })
+    measure("decode_#{type}_#{format == Pq::BINARY ? "binary" : "text"}", ops: 10, rows: WIDE_ROWS) { res.values }
+  end
+end
+
+# multi megabyte bytea values in the text format, decoded and as the raw \x... text like before bytea was decoded
+bytea = "select decode(repeat('0123456789abcdef', $1::int / 8), 'hex')"
+[1, 4, 16].each do |megabytes|
+  size = megabytes * 1024 * 1024
+  conn.types.decode_as("bytea", "text")
+  measure("bytea_#{megabytes}mib_raw", ops: 10, rows: 1, bytes: size) { check(conn.exec(bytea, size)).getvalue(0, 0) }
+  conn.types.unregister("bytea")
+  measure("bytea_#{megabytes}mib_decoded", ops: 10, rows: 1, bytes: size) { check(conn.exec(bytea, size)).getvalue(0, 0) }
+end
+
+# inserts with eight arguments of mixed types, unprepared and prepared
+insert = "insert into bench_insert values ($1, $2, $3, $4, $5, $6, $7, $8)"
+created = Time.at(1_600_000_000)
+tags = ["a", "b", "c"]
+check(conn.exec("begin"))
+id = 0
+measure("insert_params_exec", ops: OPS, rows: 1) { check(conn.exec(insert, id += 1, "name", 1.5, true, created, nil, tags, 42)) }
+statement = conn.prepare("bench_insert", insert)
+measure("insert_params_prepared", ops: OPS, rows: 1) { check(statement.exec(id += 1, "name", 1.5, true, created, nil, tags, 42)) }
+check(conn.exec("commit"))
+
+check(conn.exec("drop table bench_items, bench_scan, bench_insert"))
+conn.close
@@ -0,0 +1,37 @@
+class Pq
+  # a json or jsonb value which is only parsed once it's used
+  class JSON
+    def to_s
+      @raw
+    end
+    alias_method :to_str, :to_s
+
+    def value
+      unless @parsed
+        @value = Object.const_defined?(:JSON) ? ::JSON.parse(@raw) : @raw
+        @parsed = true
+      end
+      @value
+    end
+
+    def parsed?
+      !!@parsed
+    end
+
+    def ==(other)
+      other.is_a?(JSON) ? value == other.value : value == other
+    end
+
+    def inspect
+      "#<Pq::JSON #{@raw}>"
+    end
+
+    def respond_to_missing?(name, include_all = false)
+      value.respond_to?(name, include_all)
+    end
+
+    def method_missing(name, *args, &block)
+      value.__send__(name, *args, &block)
+    end
+  end # class JSON
+end # class Pq
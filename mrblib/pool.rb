@@ -0,0 +1,136 @@
+class Pq
+  class Pool
+    class ExhaustedError < Pq::Error; end
+
+    attr_reader :min, :max
+
+    def initialize(conninfo = "", min: 0, max: 5)
+      raise ArgumentError, "max must be at least 1" if max < 1
+      raise ArgumentError, "min can't be larger than max" if min > max
+      @conninfo, @min, @max = conninfo, min, max
+      @idle = []
+      @busy = []
+      # idle connections with a reset in progress and what reset_poll waits for on their socket
+      @resetting = {}
+      @closed = false
+      @idle.concat(Pq.connect_all([@conninfo] * min)) if min > 0
+    end
+
+    def size
+      @idle.size + @busy.size
+    end
+
+    def available
+      @idle.size + @max - size
+    end
+
+    def checkout
+      raise IOError, "closed pool" if @closed
+      index = @idle.size
+      while index > 0
+        index -= 1
+        conn = @idle[index]
+        case ready?(conn)
+        when true
+          @idle.delete_at(index)
+          @busy << conn
+          return conn
+        when nil
+          @idle.delete_at(index)
+        end
+      end
+      raise ExhaustedError, "all #{@max} connections are in use or reconnecting" if size >= @max
+      conn = Pq.new(@conninfo)
+      @busy << conn
+      conn
+    end
+
+    def checkin(conn)
+      return self unless @busy.delete(conn)
+      if @closed || conn.closed?
+        conn.close unless conn.closed?
+        return self
+      end
+      if conn.status == CONNECTION_OK
+        case conn.transaction_status
+        when TRANS_INTRANS, TRANS_INERROR
+          unless rollback(conn)
+            conn.close
+            return self
+          end
+        when TRANS_ACTIVE, TRANS_UNKNOWN
+          # still busy with a query, there is no cheap way to get it back into a usable state
+          conn.close
+          return self
+        end
+      end
+      # broken connections reconnect while they are idle, checkout skips them until they are done
+      start_reset(conn) if conn.status != CONNECTION_OK
+      @idle << conn unless conn.closed?
+      self
+    end
+
+    def with
+      conn = checkout
+      begin
+        yield conn
+      ensure
+        checkin(conn)
+      end
+    end
+
+    def close
+      @closed = true
+      @idle.each(&:close)
+      @idle.clear
+      @resetting.clear
+      nil
+    end
+
+    def closed?
+      @closed
+    end
+
+    private
+
+    def rollback(conn)
+      !conn.exec("ROLLBACK").is_a?(Result::Error)
+    rescue Pq::Error, IOError, SystemCallError
+      false
+    end
+
+    def start_reset(conn)
+      conn.reset_start
+      # libpq wants to write first after reset_start
+      @resetting[conn] = :writing
+    rescue Pq::Error, IOError, SystemCallError
+      @resetting.delete(conn)
+      conn.close unless conn.closed?
+    end
+
+    # true when conn can be handed out, false while it's still reconnecting and nil once it's unusable
+    def ready?(conn)
+      return nil if conn.closed?
+      if (state = @resetting[conn])
+        # reset_poll must only be called once the socket is ready, so this never blocks
+        return false if Pq._poll([[conn, state]], 0).empty?
+        state = conn.reset_poll
+        if state != :ok
+          @resetting[conn] = state
+          return false
+        end
+        @resetting.delete(conn)
+        true
+      elsif conn.status != CONNECTION_OK
+        start_reset(conn)
+        conn.closed? ? nil : false
+      else
+        true
+      end
+    rescue Pq::Error, IOError, SystemCallError
+      @resetting.delete(conn)
+      conn.close unless conn.closed?
+      nil
+    end
+  end # class Pool
+end # class Pq
@@ -8,13 +8,386 @@ class Pq
     Stmt.new(self, stmt_name)
   end
 
+  def reset
+    _reset
+    @statement_cache.clear if @statement_cache
+    self
+  end
+
+  # continue with reset_poll until it returns :ok
+  def reset_start
+    _reset_start
+    @statement_cache.clear if @statement_cache
+    self
+  end
+
+  # opens all connections at once, the handshakes and loading of the types run in a single poll loop
+  def self.connect_all(conninfos, timeout: nil)
+    conns = []
+    begin
+      conninfos.each { |conninfo| conns << connect_start(conninfo) }
+      # libpq wants to write first after connect_start
+      waiting = conns.map { |conn| [conn, :writing] }
+      deadline = timeout && Time.now + timeout
+      until waiting.empty?
+        remaining = deadline && deadline - Time.now
+        raise ConnectionError, "timeout expired" if remaining && remaining <= 0
+        _poll(waiting, remaining).each do |index|
+          waiting[index][1] = waiting[index][0].connect_poll
+        end
+        waiting.reject! { |_, state| state == :ok }
+      end
+      conns
+    rescue => e
+      conns.each { |conn| conn.close unless conn.closed? }
+      raise e
+    end
+  end
+
+  attr_reader :statement_cache
+
+  def statement_cache=(capacity)
+    @statement_cache.deallocate_all if @statement_cache && !closed?
+    @statement_cache = capacity ? StatementCache.new(self, capacity) : nil
+  end
+
+  def result_format
+    @result_format || TEXT
+  end
+
+  def result_format=(format)
+    unless format == TEXT || format == BINARY
+      raise ArgumentError, "result format must be Pq::TEXT or Pq::BINARY"
+    end
+    @result_format = format
+  end
+
+  def with_result_format(format)
+    previous = result_format
+    self.result_format = format
+    begin
+      yield self
+    ensure
+      @result_format = previous
+    end
+  end
+
+  def chunk_size
+    @chunk_size || 1
+  end
+
+  def chunk_size=(size)
+    unless size.is_a?(Integer) && size > 0 && size <= 0x7fffffff
+      raise ArgumentError, "chunk size must be a positive Integer"
+    end
+    @chunk_size = size
+  end
+
+  # off by default, reset_stats and turning them off drop everything collected so far
+  def collect_stats=(enabled)
+    @stats = enabled ? (@stats || {}) : nil
+  end
+
+  def collect_stats?
+    !@stats.nil?
+  end
+
+  # {statement name or normalized query => {calls:, rows:, bytes:, wait_us:, encode_us:, decode_us:, latency_us: {p50:, ...}}}
+  def stats
+    stats = {}
+    @stats.each { |query, query_stats| stats[query] = query_stats.to_h } if @stats
+    stats
+  end
+
+  def query_stats(query)
+    @stats && @stats[query]
+  end
+
+  def reset_stats
+    @stats = {} if @stats
+    self
+  end
+
+  def stream(command, *args, timeout: nil, deadline: nil, &block)
+    exec(command, *args, timeout: timeout, deadline: deadline) do |res|
+      raise res if res.is_a?(Result::Error)
+      res.each_row(&block)
+      nil
+    end
+  end
+
+  # reads the rows of a server side cursor batch rows at a time, the next batch is fetched while the block handles the current one
+  def cursor(command, *args, batch: 1000, &block)
+    raise ArgumentError, "no block given" unless block
+    unless batch.is_a?(Integer) && batch > 0
+      raise ArgumentError, "batch must be a positive Integer"
+    end
+    # named by nesting depth, so the statement cache sees the same DECLARE every time
+    @cursor_depth = (@cursor_depth || 0) + 1
+    name = "pq_cursor_#{@cursor_depth}"
+    own_transaction = transaction_status == TRANS_IDLE
+    fetching = done = false
+    begin
+      raise_error(exec("BEGIN")) if own_transaction
+      raise_error(exec("DECLARE #{name} NO SCROLL CURSOR FOR #{command}", *args))
+      fetch = "FETCH #{batch} FROM #{name}"
+      send_query(fetch)
+      fetching = true
+      loop do
+        fetching = false
+        res = single_result
+        if res.ntuples == batch
+          send_query(fetch)
+          fetching = true
+        end
+        res.each_row(&block)
+        break unless fetching
+      end
+      raise_error(exec("CLOSE #{name}"))
+      raise_error(exec("COMMIT")) if own_transaction
+      done = true
+    ensure
+      # the block raised or broke out of the loop
+      unless done || closed?
+        nil while fetching && get_result
+        if own_transaction
+          exec("ROLLBACK")
+        elsif transaction_status == TRANS_INTRANS
+          exec("CLOSE #{name}")
+        end
+      end
+      @cursor_depth -= 1
+    end
+    self
+  end
+
+  # types are the oids or pg_type names of the columns, put_row then encodes the values to them, they have to be looked up before the COPY starts
+  def copy_in(command, *args, types: nil)
+    types = types.map { |type| @types.oid(type) } if types
+    res = exec(command, *args)
+    raise res if res.is_a?(Result::Error)
+    io = CopyIn.new(self, res.binary_tuples?, types)
+    done = false
+    error = nil
+    begin
+      yield io
+      done = true
+    rescue Exception => e
+      error = e
+      raise e
+    ensure
+      # raising, break and throw all abort the COPY, otherwise the connection would stay in COPY_IN
+      unless done || closed?
+        begin
+          put_copy_end(error ? error.message : "COPY aborted")
+          nil while get_result
+        rescue Pq::Error, IOError, SystemCallError
+          # the exception of the block is the one worth reporting
+        end
+      end
+    end
+    io.finish
+    single_result
+  end
+
+  def copy_out(command, *args)
+    res = exec(command, *args)
+    raise res if res.is_a?(Result::Error)
+    done = false
+    begin
+      while (data = get_copy_data)
+        yield data
+      end
+      done = true
+    ensure
+      # the server keeps sending until it's canceled, the rest is read and dropped so the connection leaves COPY_OUT
+      unless done || closed?
+        begin
+          cancel
+          nil while get_copy_data
+          nil while get_result
+        rescue Pq::Error, IOError, SystemCallError
+          # the exception of the block is the one worth reporting
+        end
+      end
+    end
+    single_result
+  end
+
+  # waits up to timeout seconds, forever when it's nil, returns the channel or nil when nothing arrived in time
+  def wait_for_notify(timeout = nil)
+    channel, payload, pid = _wait_for_notify(timeout)
+    return nil unless channel
+    yield channel, payload, pid if block_given?
+    channel
+  end
+
+  # keeps the last limit protocol messages in memory, errors get the last attach of them, with a path they are appended to that file instead
+  def trace(limit: 256, attach: 32, path: nil)
+    path ? _trace(path) : _trace(limit, attach)
+  end
+
+  def pipeline
+    enter_pipeline_mode
+    pipeline = Pipeline.new(self)
+    done = false
+    begin
+      yield pipeline
+      pipeline.sync
+      done = true
+    ensure
+      # when the block raised or broke out the results are dropped, so the original exception isn't replaced
+      if done
+        exit_pipeline_mode
+      else
+        pipeline.discard
+      end
+    end
+    pipeline.results
+  end
+
+  private def raise_error(res)
+    raise res if res.is_a?(Result::Error)
+    res
+  end
+
+  private def single_result
+    res = get_result
+    nil while get_result
+    raise res if res.is_a?(Result::Error)
+    res
+  end
+
+  class Pipeline
+    class Future
+      def initialize(pipeline)
+        @pipeline = pipeline
+        @resolved = false
+      end
+
+      def resolved?
+        @resolved
+      end
+
+      def value
+        @pipeline.sync unless @resolved
+        @value
+      end
+
+      def resolve(value)
+        @value = value
+        @resolved = true
+        self
+      end
+    end # class Future
+
+    attr_reader :results
+
+    def initialize(conn)
+      @conn = conn
+      @pending = []
+      @results = []
+      @syncs = 0 # sync points sent whose PIPELINE_SYNC result wasn't read yet
+    end
+
+    def exec(command, *args)
+      @conn.send_query(command, *args)
+      enqueue
+    end
+
+    def exec_prepared(stmt_name, *args)
+      @conn.send_prepared(stmt_name, *args)
+      enqueue
+    end
+
+    def prepare(stmt_name, query)
+      @conn.send_prepare(stmt_name, query)
+      enqueue
+    end
+
+    def sync
+      return @results if @pending.empty?
+      @conn.pipeline_sync
+      @syncs += 1
+      until @pending.empty?
+        future = @pending.shift
+        result = @conn.get_result
+        nil while @conn.get_result
+        future.resolve(result)
+        @results << result
+      end
+      @conn.get_result # the PIPELINE_SYNC marker
+      @syncs -= 1
+      @results
+    end
+
+    # reads and drops everything still on its way and leaves pipeline mode, doesn't raise
+    def discard
+      @pending.clear
+      @conn.pipeline_sync
+      @syncs += 1
+      while @syncs > 0 && @conn.status == CONNECTION_OK
+        res = @conn.get_result
+        @syncs -= 1 if res.is_a?(Result) && res.pipeline_sync?
+      end
+      @conn.exit_pipeline_mode
+    rescue Pq::Error, IOError, SystemCallError
+      nil
+    end
+
+    private
+
+    def enqueue
+      future = Future.new(self)
+      @pending << future
+      future
+    end
+  end # class Pipeline
+
+  class CopyIn
+    def initialize(conn, binary, types = nil)
+      @conn, @binary, @types = conn, binary, types
+      @conn.put_copy_data(BINARY_HEADER) if binary
+    end
+
+    def binary?
+      @binary
+    end
+
+    def put(data)
+      @conn.put_copy_data(data)
+      self
+    end
+    alias_method :<<, :put
+
+    def put_row(*values)
+      raise Pq::Error, "put_row needs a COPY in binary format" unless @binary
+      @conn.put_copy_data(CopyIn.encode_row(values, @types))
+      self
+    end
+
+    def finish
+      @conn.put_copy_data(BINARY_TRAILER) if @binary
+      @conn.put_copy_end
+    end
+  end # class CopyIn
+
   class Stmt
     def initialize(conn, stmt_name)
       @conn, @stmt_name = conn, stmt_name
     end
 
-    def exec(*args)
-      @conn.exec_prepared(@stmt_name, *args)
+    def exec(*args, timeout: nil, deadline: nil, &block)
+      @conn._exec_prepared_typed(@stmt_name, param_types, *args, timeout: timeout, deadline: deadline, &block)
+    end
+
+    # the parameter types the server inferred, arguments are encoded straight to them
+    def param_types
+      return @param_types if @param_types
+      res = describe
+      # e.g. in an aborted transaction, the next call asks again
+      return [] if res.is_a?(Result::Error)
+      @param_types = res.paramtypes
     end
 
     def describe
@@ -30,6 +403,8 @@ class Pq
     end
 
     class Error < Pq::Error
+      attr_reader :trace
+
       constants.each do |const|
         define_method(const.downcase) do
           field(self.class.const_get(const))
@@ -40,36 +415,9 @@ class Pq
     class BadResponseError < Error; end
     class NonFatalError < Error; end
     class FatalError < Error; end
+    class PipelineAbortedError < Error; end
     class InvalidOid < Error; end
 
     attr_reader :status
-
-    def to_ary
-      rows = []
-      row = 0
-      while row < ntuples
-        line = []
-        column = 0
-        while column < nfields
-          line << getvalue(row, column)
-          column += 1
-        end
-        rows << line
-        row += 1
-      end
-      rows
-    end
-
-    alias_method :values, :to_ary
-
-    def names
-      fnames = []
-      column = 0
-      while column < nfields
-        fnames << fname(column)
-        column += 1
-      end
-      fnames
-    end
   end # class Result
 end # class Pq
@@ -0,0 +1,34 @@
+class Pq
+  # rows returned by Result#each_record and Result#to_records, every column layout gets its own subclass
+  class Record < Array
+    class << self
+      attr_reader :members
+
+      def offset(member)
+        @offsets.fetch(member.to_sym) { raise NameError, "no member '#{member}' in record" }
+      end
+    end
+
+    def members
+      self.class.members
+    end
+
+    def each_pair
+      members.each_with_index { |member, i| yield member, self.at(i) }
+      self
+    end
+
+    def to_h
+      hash = {}
+      each_pair { |member, value| hash[member] = value }
+      hash
+    end
+
+    def inspect
+      fields = []
+      each_pair { |member, value| fields << "#{member}=#{value.inspect}" }
+      "#<Pq::Record #{fields.join(", ")}>"
+    end
+    alias_method :to_s, :inspect
+  end # class Record
+end # class Pq
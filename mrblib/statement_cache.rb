@@ -0,0 +1,83 @@
+class Pq
+  class StatementCache
+    attr_reader :capacity
+
+    def initialize(conn, capacity)
+      raise ArgumentError, "capacity must be at least 1" if capacity < 1
+      @conn, @capacity = conn, capacity
+      @statements = {}
+      @tick = 0
+      @counter = 0
+      # evicted statements whose DEALLOCATE failed because the transaction was aborted
+      @deferred = []
+    end
+
+    def size
+      @statements.size
+    end
+
+    def fetch(key)
+      entry = @statements[key]
+      return nil unless entry
+      entry[1] = (@tick += 1)
+      entry[0]
+    end
+
+    def store(key)
+      deallocate_deferred unless @deferred.empty?
+      evict if @statements.size >= @capacity
+      name = "pq_cached_#{@counter += 1}"
+      @statements[key] = [name, (@tick += 1)]
+      name
+    end
+
+    def delete(key)
+      @statements.delete(key)
+    end
+
+    # forgets all statements without deallocating them, they are already gone after a reset
+    def clear
+      @statements.clear
+      @deferred.clear
+      self
+    end
+
+    # the statements would only be deferred and then forgotten with the cache, so they have to wait for the end of the failed transaction
+    def deallocate_all
+      if @conn.transaction_status == TRANS_INERROR
+        raise Pq::Error, "can't deallocate the cached statements in a failed transaction, roll it back first"
+      end
+      @statements.each_value { |entry| deallocate(entry[0]) }
+      deallocate_deferred
+      @statements.clear
+      self
+    end
+
+    private
+
+    def evict
+      lru_key, lru = nil, nil
+      @statements.each do |key, entry|
+        lru_key, lru = key, entry if lru.nil? || entry[1] < lru[1]
+      end
+      @statements.delete(lru_key)
+      deallocate(lru[0])
+    end
+
+    def deallocate(name)
+      if @conn.transaction_status == TRANS_INERROR
+        @deferred << name
+      else
+        res = @conn.exec("DEALLOCATE #{name}")
+        @deferred << name if res.is_a?(Result::Error) && res.sqlstate == "25P02" # in_failed_sql_transaction
+      end
+    end
+
+    # retried once the failed transaction is over, the server still has them
+    def deallocate_deferred
+      return if @conn.transaction_status == TRANS_INERROR
+      deferred, @deferred = @deferred, []
+      deferred.each { |name| deallocate(name) }
+    end
+  end # class StatementCache
+end # class Pq
@@ -0,0 +1,63 @@
+class Pq
+  attr_reader :types
+
+  def json_mode
+    @types.json_mode
+  end
+
+  def json_mode=(mode)
+    @types.json_mode = mode
+  end
+
+  def string_views
+    @types.string_views
+  end
+
+  def string_views=(min_length)
+    @types.string_views = min_length
+  end
+
+  def time_mode
+    @types.time_mode
+  end
+
+  def time_mode=(mode)
+    @types.time_mode = mode
+  end
+
+  class TypeRegistry
+    # reads pg_type the first time, before registering anything, so domains and arrays of the type are covered too
+    def oid(type)
+      @conn.reload_types unless loaded? || @conn.closed?
+      return type if type.is_a?(Integer)
+      @oids.fetch(type.to_s) { raise ArgumentError, "unknown type #{type}" }
+    end
+
+    def register_decoder(type, &decoder)
+      raise ArgumentError, "no block given" unless decoder
+      oid = oid(type)
+      @decoders[oid] = decoder
+      _register(oid, true, 0)
+    end
+
+    def decode_as(type, native_type)
+      oid = oid(type)
+      @decoders.delete(oid)
+      _register(oid, false, oid(native_type))
+    end
+
+    def register_encoder(type, *classes, &encoder)
+      raise ArgumentError, "no block given" unless encoder
+      oid = oid(type)
+      classes.each { |klass| @encoders[klass] = [oid, encoder] }
+      self
+    end
+
+    def unregister(type)
+      oid = oid(type)
+      @decoders.delete(oid)
+      @encoders.delete_if { |_, (encoder_oid, _)| encoder_oid == oid }
+      _register(oid, false, 0)
+    end
+  end # class TypeRegistry
+end # class Pq
@@ -1,10 +1,299 @@
 #include "mrb_pq.h"
 
+static mrb_pq_type *
+mrb_pq_type_lookup(const mrb_pq_type_registry *registry, Oid oid)
+{
+  if (unlikely(!registry->slots || oid == 0)) {
+    return NULL;
+  }
+  for (uint32_t i = (oid * 2654435761u) & registry->mask;; i = (i + 1) & registry->mask) {
+    if (registry->slots[i].oid == oid) {
+      return &registry->slots[i];
+    }
+    if (registry->slots[i].oid == 0) {
+      return NULL;
+    }
+  }
+}
+
+static mrb_pq_type *
+mrb_pq_type_insert(mrb_state *mrb, mrb_pq_type_registry *registry, Oid oid)
+{
+  mrb_pq_type *type = mrb_pq_type_lookup(registry, oid);
+  if (type) {
+    return type;
+  }
+  // keep the table at most half full so misses stay short
+  if (!registry->slots || (registry->size + 1) * 2 > registry->mask + 1) {
+    uint32_t capa = registry->slots ? (registry->mask + 1) * 2 : 1024;
+    mrb_pq_type *slots = (mrb_pq_type *) mrb_calloc(mrb, capa, sizeof(mrb_pq_type));
+    if (registry->slots) {
+      for (uint32_t i = 0; i <= registry->mask; i++) {
+        if (registry->slots[i].oid) {
+          uint32_t j = (registry->slots[i].oid * 2654435761u) & (capa - 1);
+          while (slots[j].oid) {
+            j = (j + 1) & (capa - 1);
+          }
+          slots[j] = registry->slots[i];
+        }
+      }
+      mrb_free(mrb, registry->slots);
+    }
+    registry->slots = slots;
+    registry->mask = capa - 1;
+  }
+  uint32_t i = (oid * 2654435761u) & registry->mask;
+  while (registry->slots[i].oid) {
+    i = (i + 1) & registry->mask;
+  }
+  type = &registry->slots[i];
+  memset(type, 0, sizeof(*type));
+  type->oid = oid;
+  type->target = oid;
+  registry->size++;
+
+  return type;
+}
+
+// resolves domains and registrations once, so looking up the decoder of a column doesn't have to walk them
+static void
+mrb_pq_type_registry_compile(mrb_pq_type_registry *registry)
+{
+  for (uint32_t i = 0; registry->slots && i <= registry->mask; i++) {
+    mrb_pq_type *type = &registry->slots[i];
+    if (type->oid == 0) {
+      continue;
+    }
+    type->target = type->oid;
+    type->proc_type = 0;
+    const mrb_pq_type *current = type;
+    // domains of domains are allowed, the depth limit only guards against a corrupt catalog
+    for (int depth = 0; current && depth < 32; depth++) {
+      if (current->proc) {
+        type->proc_type = current->oid;
+        break;
+      }
+      if (current->decode_as) {
+        type->target = current->decode_as;
+        break;
+      }
+      type->target = current->oid;
+      if (!current->base) {
+        break;
+      }
+      type->target = current->base;
+      current = mrb_pq_type_lookup(registry, current->base);
+    }
+  }
+}
+
+#define MRB_PQ_TYPES_QUERY "select oid, typname, typtype, case when typcategory = 'A' then typelem else 0 end, typbasetype from pg_catalog.pg_type"
+
+// fills the registry from the result of MRB_PQ_TYPES_QUERY and clears it
+static void
+mrb_pq_type_registry_fill(mrb_state *mrb, mrb_value types, PGresult *res)
+{
+  mrb_pq_type_registry *registry = DATA_GET_PTR(mrb, types, &mrb_pq_type_registry_type, mrb_pq_type_registry);
+  if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+    // without access to pg_type only the builtin decoders are used
+    PQclear(res);
+    return;
+  }
+
+  struct mrb_jmpbuf* prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    mrb_value oids = mrb_iv_get(mrb, types, mrb_intern_lit(mrb, "@oids"));
+    int ntuples = PQntuples(res);
+    int arena_index = mrb_gc_arena_save(mrb);
+    for (int row_number = 0; row_number < ntuples; row_number++) {
+      Oid oid = (Oid) strtoul(PQgetvalue(res, row_number, 0), NULL, 10);
+      mrb_pq_type *type = mrb_pq_type_insert(mrb, registry, oid);
+      type->element = (Oid) strtoul(PQgetvalue(res, row_number, 3), NULL, 10);
+      type->base = (Oid) strtoul(PQgetvalue(res, row_number, 4), NULL, 10);
+      if (*PQgetvalue(res, row_number, 2) == 'c' && !type->decode_as) {
+        type->decode_as = 2249; // composite types share the format of record
+      }
+      // names aren't unique across schemas, the first one wins
+      mrb_value name = mrb_str_new(mrb, PQgetvalue(res, row_number, 1), PQgetlength(res, row_number, 1));
+      if (!mrb_hash_key_p(mrb, oids, name)) {
+        mrb_hash_set(mrb, oids, name, mrb_int_value(mrb, oid));
+      }
+      mrb_gc_arena_restore(mrb, arena_index);
+    }
+    mrb_pq_type_registry_compile(registry);
+    registry->loaded = TRUE;
+    PQclear(res);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    PQclear(res);
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+}
+
+static void
+mrb_pq_type_registry_load(mrb_state *mrb, mrb_value types, PGconn *conn)
+{
+  errno = 0;
+  mrb_pq_type_registry_fill(mrb, types, PQexec(conn, MRB_PQ_TYPES_QUERY));
+}
+
+static mrb_value
+mrb_pq_type_registry_new(mrb_state *mrb, mrb_value self)
+{
+  mrb_value types = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_DATA, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "TypeRegistry")));
+  mrb_data_init(types, mrb_calloc(mrb, 1, sizeof(mrb_pq_type_registry)), &mrb_pq_type_registry_type);
+  mrb_iv_set(mrb, types, mrb_intern_lit(mrb, "@oids"), mrb_hash_new(mrb));
+  mrb_iv_set(mrb, types, mrb_intern_lit(mrb, "@decoders"), mrb_hash_new(mrb));
+  mrb_iv_set(mrb, types, mrb_intern_lit(mrb, "@encoders"), mrb_hash_new(mrb));
+  mrb_iv_set(mrb, types, mrb_intern_lit(mrb, "@record_classes"), mrb_hash_new(mrb));
+  // for loading pg_type on first use
+  mrb_iv_set(mrb, types, mrb_intern_lit(mrb, "@conn"), self);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@types"), types);
+
+  return types;
+}
+
+static mrb_value
+mrb_pq_type_registry_register(mrb_state *mrb, mrb_value self)
+{
+  mrb_int oid, decode_as;
+  mrb_bool proc;
+  mrb_get_args(mrb, "ibi", &oid, &proc, &decode_as);
+  if (unlikely(oid <= 0 || oid > UINT32_MAX || decode_as < 0 || decode_as > UINT32_MAX)) {
+    mrb_raise(mrb, E_RANGE_ERROR, "oid out of range");
+  }
+  mrb_pq_type_registry *registry = DATA_GET_PTR(mrb, self, &mrb_pq_type_registry_type, mrb_pq_type_registry);
+  mrb_pq_type *type = mrb_pq_type_insert(mrb, registry, (Oid) oid);
+  type->proc = proc;
+  type->decode_as = (Oid) decode_as;
+  mrb_pq_type_registry_compile(registry);
+
+  return self;
+}
+
+static mrb_value
+mrb_pq_type_registry_json_mode(mrb_state *mrb, mrb_value self)
+{
+  mrb_pq_type_registry *registry = DATA_GET_PTR(mrb, self, &mrb_pq_type_registry_type, mrb_pq_type_registry);
+  switch (registry->json_mode) {
+    case MRB_PQ_JSON_PARSE:
+      return mrb_symbol_value(mrb_intern_lit(mrb, "parse"));
+    case MRB_PQ_JSON_RAW:
+      return mrb_symbol_value(mrb_intern_lit(mrb, "raw"));
+    default:
+      return mrb_symbol_value(mrb_intern_lit(mrb, "lazy"));
+  }
+}
+
+static mrb_value
+mrb_pq_type_registry_set_json_mode(mrb_state *mrb, mrb_value self)
+{
+  mrb_sym mode;
+  mrb_get_args(mrb, "n", &mode);
+  mrb_pq_type_registry *registry = DATA_GET_PTR(mrb, self, &mrb_pq_type_registry_type, mrb_pq_type_registry);
+  if (mode == mrb_intern_lit(mrb, "lazy")) {
+    registry->json_mode = MRB_PQ_JSON_LAZY;
+  } else if (mode == mrb_intern_lit(mrb, "parse")) {
+    registry->json_mode = MRB_PQ_JSON_PARSE;
+  } else if (mode == mrb_intern_lit(mrb, "raw")) {
+    registry->json_mode = MRB_PQ_JSON_RAW;
+  } else {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "json mode must be :lazy, :parse or :raw");
+  }
+
+  return mrb_symbol_value(mode);
+}
+
+static mrb_value
+mrb_pq_type_registry_string_views(mrb_state *mrb, mrb_value self)
+{
+  mrb_pq_type_registry *registry = DATA_GET_PTR(mrb, self, &mrb_pq_type_registry_type, mrb_pq_type_registry);
+  return registry->string_views ? mrb_int_value(mrb, registry->string_views) : mrb_nil_value();
+}
+
+static mrb_value
+mrb_pq_type_registry_set_string_views(mrb_state *mrb, mrb_value self)
+{
+  mrb_value min_length;
+  mrb_get_args(mrb, "o", &min_length);
+  mrb_pq_type_registry *registry = DATA_GET_PTR(mrb, self, &mrb_pq_type_registry_type, mrb_pq_type_registry);
+  if (!mrb_test(min_length)) {
+    registry->string_views = 0;
+  } else if (mrb_true_p(min_length)) {
+    registry->string_views = 1;
+  } else {
+    mrb_int length = mrb_as_int(mrb, min_length);
+    if (length < 1 || length > INT_MAX) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "the minimum length of string views must be a positive Integer");
+    }
+    registry->string_views = (int) length;
+  }
+
+  return min_length;
+}
+
+static mrb_value
+mrb_pq_type_registry_time_mode(mrb_state *mrb, mrb_value self)
+{
+  mrb_pq_type_registry *registry = DATA_GET_PTR(mrb, self, &mrb_pq_type_registry_type, mrb_pq_type_registry);
+  return mrb_symbol_value(registry->epoch_usec ? mrb_intern_lit(mrb, "usec") : mrb_intern_lit(mrb, "time"));
+}
+
+static mrb_value
+mrb_pq_type_registry_set_time_mode(mrb_state *mrb, mrb_value self)
+{
+  mrb_sym mode;
+  mrb_get_args(mrb, "n", &mode);
+  mrb_pq_type_registry *registry = DATA_GET_PTR(mrb, self, &mrb_pq_type_registry_type, mrb_pq_type_registry);
+  if (mode == mrb_intern_lit(mrb, "time")) {
+    registry->epoch_usec = FALSE;
+  } else if (mode == mrb_intern_lit(mrb, "usec")) {
+    registry->epoch_usec = TRUE;
+  } else {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "time mode must be :time or :usec");
+  }
+
+  return mrb_symbol_value(mode);
+}
+
+static mrb_value
+mrb_pq_type_registry_loaded(mrb_state *mrb, mrb_value self)
+{
+  mrb_pq_type_registry *registry = DATA_GET_PTR(mrb, self, &mrb_pq_type_registry_type, mrb_pq_type_registry);
+
+  return mrb_bool_value(registry->loaded);
+}
+
+static mrb_value
+mrb_pq_reload_types(mrb_state *mrb, mrb_value self)
+{
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+  mrb_value types = mrb_pq_types(mrb, self);
+  if (mrb_nil_p(types)) {
+    types = mrb_pq_type_registry_new(mrb, self);
+  }
+  mrb_pq_type_registry_load(mrb, types, conn);
+
+  return types;
+}
+
 static mrb_value
 mrb_PQconnectdb(mrb_state *mrb, mrb_value self)
 {
   const char *conninfo = "";
   mrb_get_args(mrb, "|z", &conninfo);
+  // pg_type is only read once the registry is used, see Pq::TypeRegistry#oid and Pq#reload_types
+  mrb_pq_type_registry_new(mrb, self);
 
   struct mrb_jmpbuf* prev_jmp = mrb->jmp;
   struct mrb_jmpbuf c_jmp;
@@ -60,24 +349,67 @@ mrb_PQreset(mrb_state *mrb, mrb_value self)
   return self;
 }
 
-static mrb_value
-mrb_PQsocket(mrb_state *mrb, mrb_value self)
+// seconds on the monotonic clock, deadlines are kept in these
+static double
+mrb_pq_now(void)
 {
-  const PGconn *conn = (const PGconn *) DATA_PTR(self);
-  if (!conn) {
-    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// nil waits forever, which is a negative deadline
+static double
+mrb_pq_deadline(mrb_state *mrb, mrb_value timeout)
+{
+  if (mrb_nil_p(timeout)) {
+    return -1;
+  }
+#ifndef MRB_WITHOUT_FLOAT
+  double seconds = (double) mrb_as_float(mrb, timeout);
+#else
+  double seconds = (double) mrb_as_int(mrb, timeout);
+#endif
+  if (seconds < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "timeout must not be negative");
   }
 
-  int socket = PQsocket(conn);
-  if (unlikely(socket == -1)) {
-    mrb_pq_handle_connection_error(mrb, self, conn);
+  return mrb_pq_now() + seconds;
+}
+
+// the handshake is driven by connect_poll, which loads the types of the server once it's done
+static mrb_value
+mrb_PQconnectStart(mrb_state *mrb, mrb_value self)
+{
+  const char *conninfo = "";
+  mrb_get_args(mrb, "|z", &conninfo);
+
+  mrb_value pq = mrb_obj_value(mrb_data_object_alloc(mrb, mrb_class_ptr(self), NULL, &mrb_PGconn_type));
+  // PQsetClientEncoding would be a blocking query, so it's part of the startup packet instead
+#ifdef MRB_UTF8_STRING
+  const char *const keywords[] = { "dbname", "client_encoding", NULL };
+  const char *const values[] = { conninfo, "UTF8", NULL };
+#else
+  const char *const keywords[] = { "dbname", NULL };
+  const char *const values[] = { conninfo, NULL };
+#endif
+  errno = 0;
+  PGconn *conn = PQconnectStartParams(keywords, values, 1);
+  if (unlikely(!conn)) {
+    mrb_sys_fail(mrb, "PQconnectStart");
   }
+  mrb_data_init(pq, conn, &mrb_PGconn_type);
+  if (unlikely(PQstatus(conn) == CONNECTION_BAD)) {
+    mrb_pq_handle_connection_error(mrb, pq, conn);
+  }
+  mrb_pq_type_registry_new(mrb, pq);
+  mrb_iv_set(mrb, pq, mrb_intern_lit(mrb, "@connecting"), mrb_symbol_value(mrb_intern_lit(mrb, "connect")));
 
-  return mrb_int_value(mrb, socket);
+  return pq;
 }
 
 static mrb_value
-mrb_PQrequestCancel(mrb_state *mrb, mrb_value self)
+mrb_PQresetStart(mrb_state *mrb, mrb_value self)
 {
   PGconn *conn = (PGconn *) DATA_PTR(self);
   if (!conn) {
@@ -85,527 +417,4259 @@ mrb_PQrequestCancel(mrb_state *mrb, mrb_value self)
   }
 
   errno = 0;
-  int success = PQrequestCancel(conn);
-  if (unlikely(!success)) {
+  if (unlikely(!PQresetStart(conn))) {
     mrb_pq_handle_connection_error(mrb, self, conn);
   }
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@connecting"), mrb_symbol_value(mrb_intern_lit(mrb, "reset")));
 
-  return mrb_symbol_value(mrb_intern_lit(mrb, "cancel"));
+  return self;
 }
 
-static const char *
-mrb_pq_encode_value(mrb_state *mrb, mrb_value value, Oid *paramType, int *paramLength, int *paramFormat)
+// returns :reading or :writing, what to wait for on the socket before calling it again, and :ok once the connection is ready
+static mrb_value
+mrb_pq_connect_poll(mrb_state *mrb, mrb_value self)
 {
-  switch(mrb_type(value)) {
-    case MRB_TT_FALSE: {
-      if (!mrb_integer(value)) {
-        *paramType = 0;
-        *paramLength = 0;
-        *paramFormat = 0;
-        return NULL;
-      } else {
-        *paramType = 16;
-        *paramLength = 1;
-        *paramFormat = 0;
-        return "f";
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  mrb_sym connecting_sym = mrb_intern_lit(mrb, "@connecting");
+  mrb_value connecting = mrb_iv_get(mrb, self, connecting_sym);
+  if (!mrb_symbol_p(connecting)) {
+    return mrb_symbol_value(mrb_intern_lit(mrb, "ok"));
+  }
+  mrb_sym state = mrb_symbol(connecting);
+
+  errno = 0;
+  mrb_sym drain_sym = mrb_intern_lit(mrb, "types_drain");
+  if (state == mrb_intern_lit(mrb, "types") || state == drain_sym) {
+    if (unlikely(!PQconsumeInput(conn))) {
+      mrb_iv_set(mrb, self, connecting_sym, mrb_nil_value());
+      mrb_pq_handle_connection_error(mrb, self, conn);
+    }
+    if (state != drain_sym) {
+      if (PQisBusy(conn)) {
+        return mrb_symbol_value(mrb_intern_lit(mrb, "reading"));
       }
-    } break;
-    case MRB_TT_TRUE: {
-      *paramType = 16;
-      *paramLength = 1;
-      *paramFormat = 0;
-      return "t";
-    } break;
-    case MRB_TT_INTEGER: {
-      *paramFormat = 1;
-      return mrb_pq_encode_integer(mrb, value, paramType, paramLength);
-    } break;
-#ifndef MRB_WITHOUT_FLOAT
-    case MRB_TT_FLOAT: {
-      *paramFormat = 1;
-      return mrb_pq_encode_float(mrb, value, paramType, paramLength);
-    } break;
-#endif
-    default: {
-      value = mrb_str_to_str(mrb, value);
-      *paramType = 0;
-      *paramLength = RSTRING_LEN(value);
-      *paramFormat = 1;
-      return RSTRING_PTR(value);
+      mrb_iv_set(mrb, self, connecting_sym, mrb_symbol_value(drain_sym));
+      mrb_pq_type_registry_fill(mrb, mrb_pq_types(mrb, self), PQgetResult(conn));
+    }
+    // only the first PQgetResult is known not to block, the end of the query may still be on its way
+    while (!PQisBusy(conn)) {
+      PGresult *rest = PQgetResult(conn);
+      if (!rest) {
+        mrb_iv_set(mrb, self, connecting_sym, mrb_nil_value());
+        return mrb_symbol_value(mrb_intern_lit(mrb, "ok"));
+      }
+      PQclear(rest);
     }
+    return mrb_symbol_value(mrb_intern_lit(mrb, "reading"));
+  }
+
+  PostgresPollingStatusType status = state == mrb_intern_lit(mrb, "reset") ? PQresetPoll(conn) : PQconnectPoll(conn);
+  switch (status) {
+    case PGRES_POLLING_READING:
+      return mrb_symbol_value(mrb_intern_lit(mrb, "reading"));
+    case PGRES_POLLING_WRITING:
+      return mrb_symbol_value(mrb_intern_lit(mrb, "writing"));
+    case PGRES_POLLING_OK:
+      break;
+    default:
+      mrb_iv_set(mrb, self, connecting_sym, mrb_nil_value());
+      mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  // a reset keeps the types it already knows, a new connection reads them without blocking
+  if (state == mrb_intern_lit(mrb, "reset") || unlikely(!PQsendQuery(conn, MRB_PQ_TYPES_QUERY))) {
+    mrb_iv_set(mrb, self, connecting_sym, mrb_nil_value());
+    return mrb_symbol_value(mrb_intern_lit(mrb, "ok"));
   }
+  mrb_iv_set(mrb, self, connecting_sym, mrb_symbol_value(mrb_intern_lit(mrb, "types")));
+
+  return mrb_symbol_value(mrb_intern_lit(mrb, "reading"));
 }
 
+// waiting is an Array of [conn, :reading or :writing], returns the indexes of those which are ready, none when the timeout passed
 static mrb_value
-mrb_pq_result_processor(mrb_state *mrb, struct RClass *pq_result_class, PGresult *res)
+mrb_pq_poll(mrb_state *mrb, mrb_value self)
 {
-  struct mrb_jmpbuf* prev_jmp = mrb->jmp;
-  struct mrb_jmpbuf c_jmp;
-  mrb_value return_val;
+  mrb_value *waiting;
+  mrb_int nwaiting;
+  mrb_value timeout = mrb_nil_value();
+  mrb_get_args(mrb, "a|o", &waiting, &nwaiting, &timeout);
+  mrb_value ready = mrb_ary_new(mrb);
+  if (nwaiting == 0) {
+    return ready;
+  }
 
-  MRB_TRY(&c_jmp)
-  {
-    mrb->jmp = &c_jmp;
-    switch(PQresultStatus(res)) {
-      case PGRES_EMPTY_QUERY: {
-        return_val = mrb_exc_new_str(mrb, mrb_class_get_under(mrb, pq_result_class, "EmptyQueryError"), mrb_str_new_cstr(mrb, PQresultErrorMessage(res)));
-      } break;
-      case PGRES_BAD_RESPONSE: {
-        return_val = mrb_exc_new_str(mrb, mrb_class_get_under(mrb, pq_result_class, "BadResponseError"), mrb_str_new_cstr(mrb, PQresultErrorMessage(res)));
-      } break;
-      case PGRES_NONFATAL_ERROR: {
-        return_val = mrb_exc_new_str(mrb, mrb_class_get_under(mrb, pq_result_class, "NonFatalError"), mrb_str_new_cstr(mrb, PQresultErrorMessage(res)));
-      } break;
-      case PGRES_FATAL_ERROR: {
-        return_val = mrb_exc_new_str(mrb, mrb_class_get_under(mrb, pq_result_class, "FatalError"), mrb_str_new_cstr(mrb, PQresultErrorMessage(res)));
-      } break;
-      default: {
-        return_val = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_DATA, pq_result_class));
-        mrb_iv_set(mrb, return_val, mrb_intern_lit(mrb, "@status"), mrb_int_value(mrb, PQresultStatus(res)));
-      }
+  struct pollfd fds[nwaiting];
+  for (mrb_int i = 0; i < nwaiting; i++) {
+    if (!mrb_array_p(waiting[i]) || RARRAY_LEN(waiting[i]) != 2 || !mrb_symbol_p(RARRAY_PTR(waiting[i])[1])) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "expected [conn, :reading or :writing]");
     }
-    mrb_data_init(return_val, res, &mrb_PGresult_type);
-    mrb->jmp = prev_jmp;
+    mrb_value pq = RARRAY_PTR(waiting[i])[0];
+    PGconn *conn = (PGconn *) mrb_data_get_ptr(mrb, pq, &mrb_PGconn_type);
+    if (!conn) {
+      mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    }
+    errno = 0;
+    fds[i].fd = PQsocket(conn);
+    if (unlikely(fds[i].fd == -1)) {
+      mrb_pq_handle_connection_error(mrb, pq, conn);
+    }
+    fds[i].events = mrb_symbol(RARRAY_PTR(waiting[i])[1]) == mrb_intern_lit(mrb, "writing") ? POLLOUT : POLLIN;
+    fds[i].revents = 0;
   }
-  MRB_CATCH(&c_jmp)
-  {
-    mrb->jmp = prev_jmp;
-    PQclear(res);
-    MRB_THROW(mrb->jmp);
+
+  double deadline = mrb_pq_deadline(mrb, timeout);
+  int nready;
+  for (;;) {
+    int timeout_ms = -1;
+    if (deadline >= 0) {
+      double remaining = deadline - mrb_pq_now();
+      timeout_ms = remaining > 0 ? (int) ceil(remaining * 1000) : 0;
+    }
+    nready = poll(fds, (nfds_t) nwaiting, timeout_ms);
+    if (nready >= 0) {
+      break;
+    } else if (unlikely(errno != EINTR)) {
+      mrb_sys_fail(mrb, "poll");
+    }
+  }
+  for (mrb_int i = 0; i < nwaiting && nready > 0; i++) {
+    if (fds[i].revents) {
+      mrb_ary_push(mrb, ready, mrb_int_value(mrb, i));
+      nready--;
+    }
   }
-  MRB_END_EXC(&c_jmp);
 
-  return return_val;
+  return ready;
 }
 
 static mrb_value
-mrb_pq_consume_each_row(mrb_state *mrb, mrb_value self, PGconn *conn, mrb_value block)
+mrb_PQstatus(mrb_state *mrb, mrb_value self)
 {
-  int arena_index = mrb_gc_arena_save(mrb);
-  struct mrb_jmpbuf* prev_jmp = mrb->jmp;
-  struct RClass *pq_result_class = mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result");
-  struct mrb_jmpbuf c_jmp;
+  const PGconn *conn = (const PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
 
-  PQsetSingleRowMode(conn);
-  PGresult *res = PQgetResult(conn);
-  mrb_sym cancel = mrb_intern_lit(mrb, "cancel");
+  return mrb_int_value(mrb, PQstatus(conn));
+}
+
+static mrb_value
+mrb_PQtransactionStatus(mrb_state *mrb, mrb_value self)
+{
+  const PGconn *conn = (const PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  return mrb_int_value(mrb, PQtransactionStatus(conn));
+}
+
+static mrb_value
+mrb_pq_closed(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(DATA_PTR(self) == NULL);
+}
+
+static mrb_value
+mrb_PQsocket(mrb_state *mrb, mrb_value self)
+{
+  const PGconn *conn = (const PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  int socket = PQsocket(conn);
+  if (unlikely(socket == -1)) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return mrb_int_value(mrb, socket);
+}
+
+// 1 once fd is ready for events, 0 once the deadline passed and -1 with errno set when poll failed, doesn't raise
+static int
+mrb_pq_wait_fd(int fd, short events, double deadline)
+{
+  struct pollfd pfd = { fd, events, 0 };
+  for (;;) {
+    int timeout = -1;
+    if (deadline >= 0) {
+      double remaining = deadline - mrb_pq_now();
+      if (remaining <= 0) {
+        return 0;
+      }
+      timeout = (int) ceil(remaining * 1000);
+    }
+    int ready = poll(&pfd, 1, timeout);
+    if (ready > 0) {
+      return 1;
+    } else if (unlikely(ready == -1 && errno != EINTR)) {
+      return -1;
+    }
+  }
+}
+
+// waits until the socket of conn is readable or writable, returns FALSE once the deadline passed
+static mrb_bool
+mrb_pq_wait_socket(mrb_state *mrb, mrb_value self, PGconn *conn, mrb_bool for_write, double deadline)
+{
+  errno = 0;
+  int fd = PQsocket(conn);
+  if (unlikely(fd == -1)) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  int ready = mrb_pq_wait_fd(fd, for_write ? POLLOUT : POLLIN, deadline);
+  if (unlikely(ready == -1)) {
+    mrb_sys_fail(mrb, "poll");
+  }
+
+  return ready == 1;
+}
+
+// how long a cancel request and the results which are still on their way may take after a deadline passed
+#define MRB_PQ_CANCEL_TIMEOUT 5.0
+
+// asks the server to cancel the running query, the message of a failure ends up in errbuf, doesn't raise
+static mrb_bool
+mrb_pq_cancel(PGconn *conn, double deadline, char *errbuf, int errbufsize)
+{
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+  PGcancelConn *cancel = PQcancelCreate(conn);
+  if (unlikely(!cancel)) {
+    snprintf(errbuf, errbufsize, "out of memory");
+    return FALSE;
+  }
+  PostgresPollingStatusType status = PQcancelStart(cancel) ? PGRES_POLLING_WRITING : PGRES_POLLING_FAILED;
+  while (status == PGRES_POLLING_READING || status == PGRES_POLLING_WRITING) {
+    int ready = mrb_pq_wait_fd(PQcancelSocket(cancel), status == PGRES_POLLING_WRITING ? POLLOUT : POLLIN, deadline);
+    if (ready != 1) {
+      snprintf(errbuf, errbufsize, "%s", ready == 0 ? "timeout expired" : strerror(errno));
+      PQcancelFinish(cancel);
+      return FALSE;
+    }
+    status = PQcancelPoll(cancel);
+  }
+  if (status != PGRES_POLLING_OK) {
+    snprintf(errbuf, errbufsize, "%s", PQcancelErrorMessage(cancel));
+  }
+  PQcancelFinish(cancel);
+
+  return status == PGRES_POLLING_OK;
+#else
+  // PQcancel blocks while it connects, but unlike PQrequestCancel it is at least not deprecated
+  PGcancel *cancel = PQgetCancel(conn);
+  if (unlikely(!cancel)) {
+    snprintf(errbuf, errbufsize, "%s", PQerrorMessage(conn));
+    return FALSE;
+  }
+  int success = PQcancel(cancel, errbuf, errbufsize);
+  PQfreeCancel(cancel);
+
+  return success;
+#endif
+}
+
+// frees the results which are still on their way, returns FALSE when the deadline passed first or the connection broke
+static mrb_bool
+mrb_pq_drain(PGconn *conn, double deadline)
+{
+  PGresult *res;
+  for (;;) {
+    while (!PQisBusy(conn)) {
+      if (!(res = PQgetResult(conn))) {
+        return TRUE;
+      }
+      PQclear(res);
+    }
+    if (mrb_pq_wait_fd(PQsocket(conn), POLLIN, deadline) != 1 || !PQconsumeInput(conn)) {
+      break;
+    }
+  }
+  if (PQstatus(conn) == CONNECTION_BAD) {
+    while ((res = PQgetResult(conn))) {
+      PQclear(res);
+    }
+  }
+
+  return FALSE;
+}
+
+// cancels the running query and drops what it still returns, the connection can be used again afterwards unless the server didn't react in time
+static void
+mrb_pq_cancel_and_drain(PGconn *conn)
+{
+  char errbuf[256];
+  double deadline = mrb_pq_now() + MRB_PQ_CANCEL_TIMEOUT;
+  mrb_pq_cancel(conn, deadline, errbuf, sizeof(errbuf));
+  mrb_pq_drain(conn, deadline);
+}
+
+static void
+mrb_pq_raise_timeout(mrb_state *mrb, mrb_value self, PGconn *conn, PGresult *pending)
+{
+  PQclear(pending);
+  mrb_pq_cancel_and_drain(conn);
+  mrb_raise(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "TimeoutError"), "deadline exceeded, the query was canceled");
+}
+
+// PQgetResult which gives up at the deadline, pending is a result of the caller which is freed when this raises
+static PGresult *
+mrb_pq_get_result_until(mrb_state *mrb, mrb_value self, PGconn *conn, double deadline, PGresult *pending)
+{
+  if (deadline < 0) {
+    return PQgetResult(conn);
+  }
+
+  for (;;) {
+    errno = 0;
+    int flushed = PQflush(conn);
+    if (flushed == 0 && !PQisBusy(conn)) {
+      return PQgetResult(conn);
+    }
+    int fd = PQsocket(conn);
+    if (unlikely(flushed == -1 || fd == -1)) {
+      PQclear(pending);
+      mrb_pq_handle_connection_error(mrb, self, conn);
+    }
+    // a non-blocking connection may still have parts of the query to send
+    int ready = mrb_pq_wait_fd(fd, flushed == 1 ? POLLIN | POLLOUT : POLLIN, deadline);
+    if (ready == 0) {
+      mrb_pq_raise_timeout(mrb, self, conn, pending);
+    } else if (unlikely(ready == -1)) {
+      PQclear(pending);
+      mrb_sys_fail(mrb, "poll");
+    }
+    errno = 0;
+    if (unlikely(!PQconsumeInput(conn))) {
+      PQclear(pending);
+      mrb_pq_handle_connection_error(mrb, self, conn);
+    }
+  }
+}
+
+// finishes a query which was handed to one of the PQsend functions like PQexec would, but waits at most until the deadline
+static PGresult *
+mrb_pq_exec_sent(mrb_state *mrb, mrb_value self, PGconn *conn, int sent, double deadline)
+{
+  if (unlikely(!sent)) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  PGresult *last = NULL, *res;
+  while ((res = mrb_pq_get_result_until(mrb, self, conn, deadline, last))) {
+    PQclear(last);
+    last = res;
+    ExecStatusType status = PQresultStatus(res);
+    if (status == PGRES_COPY_IN || status == PGRES_COPY_OUT || status == PGRES_COPY_BOTH || PQstatus(conn) == CONNECTION_BAD) {
+      break;
+    }
+  }
+
+  return last;
+}
+
+#define MRB_PQ_DEADLINE_KWARGS(kwargs, kw_values) \
+  const mrb_sym kwargs##_names[] = { mrb_intern_lit(mrb, "timeout"), mrb_intern_lit(mrb, "deadline") }; \
+  mrb_value kw_values[2]; \
+  mrb_kwargs kwargs = { 2, 0, kwargs##_names, kw_values, NULL }
+
+// the timeout: (seconds) and deadline: (a Time) keywords of exec, exec_prepared and streaming, -1 when neither is given
+static double
+mrb_pq_query_deadline(mrb_state *mrb, mrb_value self, const mrb_value *kw_values)
+{
+  mrb_value timeout = kw_values[0], deadline = kw_values[1];
+  double at;
+  if (!mrb_undef_p(deadline) && !mrb_nil_p(deadline)) {
+    if (!mrb_undef_p(timeout) && !mrb_nil_p(timeout)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "timeout and deadline can't be combined");
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+#ifndef MRB_WITHOUT_FLOAT
+    double wall = (double) mrb_as_float(mrb, mrb_funcall(mrb, deadline, "to_f", 0));
+#else
+    double wall = (double) mrb_as_int(mrb, mrb_funcall(mrb, deadline, "to_i", 0));
+#endif
+    at = mrb_pq_now() + (wall - ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9));
+  } else if (!mrb_undef_p(timeout) && !mrb_nil_p(timeout)) {
+    at = mrb_pq_deadline(mrb, timeout);
+  } else {
+    return -1;
+  }
+  // nothing is sent when there is no time left anyway
+  if (at <= mrb_pq_now()) {
+    mrb_raise(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "TimeoutError"), "deadline exceeded before the query was sent");
+  }
 
+  return at;
+}
+
+// [channel, payload, pid], the notify is freed in any case
+static mrb_value
+mrb_pq_notify_value(mrb_state *mrb, PGnotify *notify)
+{
+  mrb_value value = mrb_nil_value();
+  struct mrb_jmpbuf* prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
   MRB_TRY(&c_jmp)
   {
     mrb->jmp = &c_jmp;
-    while (res) {
-      mrb_value ret = mrb_yield(mrb, block, mrb_pq_result_processor(mrb, pq_result_class, res));
-      mrb_gc_arena_restore(mrb, arena_index);
-      if (mrb_symbol_p(ret) && mrb_symbol(ret) == cancel) {
-        while ((res = PQgetResult(conn))) {
-          PQclear(res);
-        }
-        break;
-      }
-      res = PQgetResult(conn);
-    }
+    mrb_value values[3] = { mrb_str_new_cstr(mrb, notify->relname), mrb_str_new_cstr(mrb, notify->extra), mrb_int_value(mrb, notify->be_pid) };
+    value = mrb_ary_new_from_values(mrb, 3, values);
+    PQfreemem(notify);
     mrb->jmp = prev_jmp;
   }
   MRB_CATCH(&c_jmp)
   {
     mrb->jmp = prev_jmp;
-    PQrequestCancel(conn);
-    while ((res = PQgetResult(conn))) {
-      PQclear(res);
-    }
+    PQfreemem(notify);
     MRB_THROW(mrb->jmp);
   }
   MRB_END_EXC(&c_jmp);
 
-  return self;
+  return value;
 }
 
+// libpq queues notifications which arrive while waiting for results, they stay there until they are read here
 static mrb_value
-mrb_PQexec(mrb_state *mrb, mrb_value self)
+mrb_PQnotifies(mrb_state *mrb, mrb_value self)
 {
-  const char *command;
-  mrb_value *paramValues_val = NULL;
-  mrb_int nParams = 0;
-  mrb_value block = mrb_nil_value();
-  mrb_get_args(mrb, "z|*&", &command, &paramValues_val, &nParams, &block);
   PGconn *conn = (PGconn *) DATA_PTR(self);
   if (!conn) {
     mrb_raise(mrb, E_IO_ERROR, "closed stream");
   }
 
   errno = 0;
-  if (mrb_type(block) == MRB_TT_PROC) {
-    int success = FALSE;
-    if (nParams) {
-      Oid paramTypes[nParams];
-      const char *paramValues[nParams];
-      int paramLengths[nParams];
-      int paramFormats[nParams];
-      int arena_index = mrb_gc_arena_save(mrb);
-      for (mrb_int i = 0; i < nParams; i++) {
-        paramValues[i] = mrb_pq_encode_value(mrb, paramValues_val[i], &paramTypes[i], &paramLengths[i], &paramFormats[i]);
-      }
-      success = PQsendQueryParams(conn, command, nParams, paramTypes, paramValues, paramLengths, paramFormats, 0);
-      mrb_gc_arena_restore(mrb, arena_index);
-    } else {
-      success = PQsendQuery(conn, command);
-    }
-    if (likely(success)) {
-      return mrb_pq_consume_each_row(mrb, self, conn, block);
-    } else {
-      mrb_pq_handle_connection_error(mrb, self, conn);
-    }
-  } else {
-    PGresult *res = NULL;
-    if (nParams) {
-      Oid paramTypes[nParams];
-      const char *paramValues[nParams];
-      int paramLengths[nParams];
-      int paramFormats[nParams];
-      int arena_index = mrb_gc_arena_save(mrb);
-      for (mrb_int i = 0; i < nParams; i++) {
-        paramValues[i] = mrb_pq_encode_value(mrb, paramValues_val[i], &paramTypes[i], &paramLengths[i], &paramFormats[i]);
-      }
-      res = PQexecParams(conn, command, nParams, paramTypes, paramValues, paramLengths, paramFormats, 0);
-      mrb_gc_arena_restore(mrb, arena_index);
-    } else {
-      res = PQexec(conn, command);
-    }
-    if (likely(res)) {
-      return mrb_pq_result_processor(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result"), res);
-    } else {
-      mrb_sys_fail(mrb, PQresultErrorMessage(res));
-    }
+  if (unlikely(!PQconsumeInput(conn))) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+  mrb_value notifies = mrb_ary_new(mrb);
+  int arena_index = mrb_gc_arena_save(mrb);
+  PGnotify *notify;
+  while ((notify = PQnotifies(conn))) {
+    mrb_ary_push(mrb, notifies, mrb_pq_notify_value(mrb, notify));
+    mrb_gc_arena_restore(mrb, arena_index);
   }
 
-  return self;
+  return notifies;
 }
 
 static mrb_value
-mrb_PQprepare(mrb_state *mrb, mrb_value self)
+mrb_pq_wait_for_notify(mrb_state *mrb, mrb_value self)
 {
-  const char *stmtName, *query;
-  mrb_get_args(mrb, "zz", &stmtName, &query);
+  mrb_value timeout = mrb_nil_value();
+  mrb_get_args(mrb, "|o", &timeout);
   PGconn *conn = (PGconn *) DATA_PTR(self);
   if (!conn) {
     mrb_raise(mrb, E_IO_ERROR, "closed stream");
   }
 
-  errno = 0;
-  PGresult *res = PQprepare(conn, stmtName, query, 0, NULL);
-  if (likely(res)) {
-    return mrb_pq_result_processor(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result"), res);
-  } else {
-    mrb_sys_fail(mrb, PQresultErrorMessage(res));
+  double deadline = mrb_pq_deadline(mrb, timeout);
+  PGnotify *notify;
+  while (!(notify = PQnotifies(conn))) {
+    if (!mrb_pq_wait_socket(mrb, self, conn, FALSE, deadline)) {
+      return mrb_nil_value();
+    }
+    errno = 0;
+    if (unlikely(!PQconsumeInput(conn))) {
+      mrb_pq_handle_connection_error(mrb, self, conn);
+    }
   }
 
-  return self;
+  return mrb_pq_notify_value(mrb, notify);
 }
 
+// cancels the running query without waiting for it, gives up after MRB_PQ_CANCEL_TIMEOUT seconds
 static mrb_value
-mrb_PQexecPrepared(mrb_state *mrb, mrb_value self)
+mrb_pq_request_cancel(mrb_state *mrb, mrb_value self)
 {
-  const char *stmtName;
-  mrb_value *paramValues_val = NULL;
-  mrb_int nParams = 0;
-  mrb_value block = mrb_nil_value();
-  mrb_get_args(mrb, "z|*&", &stmtName, &paramValues_val, &nParams, &block);
   PGconn *conn = (PGconn *) DATA_PTR(self);
   if (!conn) {
     mrb_raise(mrb, E_IO_ERROR, "closed stream");
   }
 
+  char errbuf[256];
   errno = 0;
-  if (mrb_type(block) == MRB_TT_PROC) {
-    int success = FALSE;
-    if (nParams) {
-      Oid paramTypes[nParams];
-      const char *paramValues[nParams];
-      int paramLengths[nParams];
-      int paramFormats[nParams];
-      int arena_index = mrb_gc_arena_save(mrb);
-      for (mrb_int i = 0; i < nParams; i++) {
-        paramValues[i] = mrb_pq_encode_value(mrb, paramValues_val[i], &paramTypes[i], &paramLengths[i], &paramFormats[i]);
-      }
-      success = PQsendQueryPrepared(conn, stmtName, nParams, paramValues, paramLengths, paramFormats, 0);
-      mrb_gc_arena_restore(mrb, arena_index);
-    } else {
-      success = PQsendQueryPrepared(conn, stmtName, nParams, NULL, NULL, NULL, 0);
+  if (unlikely(!mrb_pq_cancel(conn, mrb_pq_now() + MRB_PQ_CANCEL_TIMEOUT, errbuf, sizeof(errbuf)))) {
+    mrb_raise(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "ConnectionError"), errbuf);
+  }
+
+  return mrb_symbol_value(mrb_intern_lit(mrb, "cancel"));
+}
+
+static Oid
+mrb_pq_array_element_type(Oid arrayType)
+{
+  switch (arrayType) {
+    case 1000: return 16; // bool[]
+    case 1001: return 17; // bytea[]
+    case 1002: return 18; // char[]
+    case 1003: return 19; // name[]
+    case 1005: return 21; // int2[]
+    case 1007: return 23; // int4[]
+    case 1016: return 20; // int8[]
+    case 1028: return 26; // oid[]
+    case 1021: return 700; // float4[]
+    case 1022: return 701; // float8[]
+    case 1009: return 25; // text[]
+    case 1014: return 1042; // bpchar[]
+    case 1015: return 1043; // varchar[]
+    case 199: return 114; // json[]
+    case 3807: return 3802; // jsonb[]
+    case 143: return 142; // xml[]
+    case 1231: return 1700; // numeric[]
+    case 2951: return 2950; // uuid[]
+    case 1182: return 1082; // date[]
+    case 1115: return 1114; // timestamp[]
+    case 1185: return 1184; // timestamptz[]
+    case 1183: return 1083; // time[]
+    case 1187: return 1186; // interval[]
+    case 2287: return 2249; // record[]
+    default: return 0;
+  }
+}
+
+static Oid
+mrb_pq_array_type(Oid elementType)
+{
+  switch (elementType) {
+    case 16: return 1000;
+    case 21: return 1005;
+    case 23: return 1007;
+    case 20: return 1016;
+    case 26: return 1028;
+    case 700: return 1021;
+    case 701: return 1022;
+    case 25: return 1009;
+    case 1043: return 1015;
+    case 1082: return 1182;
+    case 1114: return 1115;
+    case 1184: return 1185;
+    default: return 0;
+  }
+}
+
+static Oid
+mrb_pq_infer_array_element_type(mrb_state *mrb, const mrb_value *elements, mrb_int nelements)
+{
+  Oid elementType = 0;
+  for (mrb_int i = 0; i < nelements; i++) {
+    Oid type;
+    switch (mrb_type(elements[i])) {
+      case MRB_TT_FALSE: {
+        if (!mrb_integer(elements[i])) {
+          continue;
+        }
+        type = 16;
+      } break;
+      case MRB_TT_TRUE:
+        type = 16;
+        break;
+      case MRB_TT_INTEGER:
+        type = 20;
+        break;
+#ifndef MRB_WITHOUT_FLOAT
+      case MRB_TT_FLOAT:
+        type = 701;
+        break;
+#endif
+      case MRB_TT_STRING:
+        type = 25;
+        break;
+      default:
+        if (!mrb_pq_time_p(mrb, elements[i])) {
+          mrb_raisef(mrb, E_TYPE_ERROR, "cannot send %T as an array element", elements[i]);
+        }
+        type = 1184;
     }
-    if (likely(success)) {
-      return mrb_pq_consume_each_row(mrb, self, conn, block);
+    if (elementType == 0 || elementType == type) {
+      elementType = type;
+    } else if ((elementType == 20 && type == 701) || (elementType == 701 && type == 20)) {
+      elementType = 701;
     } else {
-      mrb_pq_handle_connection_error(mrb, self, conn);
+      mrb_raise(mrb, E_TYPE_ERROR, "array elements must all be of the same type");
     }
-  } else {
-    PGresult *res = NULL;
-    if (nParams) {
-      Oid paramTypes[nParams];
-      const char *paramValues[nParams];
-      int paramLengths[nParams];
-      int paramFormats[nParams];
-      int arena_index = mrb_gc_arena_save(mrb);
-      for (mrb_int i = 0; i < nParams; i++) {
-        paramValues[i] = mrb_pq_encode_value(mrb, paramValues_val[i], &paramTypes[i], &paramLengths[i], &paramFormats[i]);
-      }
-      res = PQexecPrepared(conn, stmtName, nParams, paramValues, paramLengths, paramFormats, 0);
-      mrb_gc_arena_restore(mrb, arena_index);
-    } else {
-      res = PQexecPrepared(conn, stmtName, nParams, NULL, NULL, NULL, 0);
+  }
+
+  return elementType ? elementType : 25;
+}
+
+// encodes a flat Array in the binary array format: ndim, has nulls, element type, dimension and lower bound, then each element
+static const char *
+mrb_pq_encode_array(mrb_state *mrb, mrb_value value, Oid declaredType, Oid *paramType, int *paramLength, int *paramFormat)
+{
+  const mrb_value *elements = RARRAY_PTR(value);
+  mrb_int nelements = RARRAY_LEN(value);
+  if (unlikely(nelements > INT32_MAX)) {
+    mrb_raise(mrb, E_RANGE_ERROR, "array too large");
+  }
+  Oid elementType = mrb_pq_array_element_type(declaredType);
+  if (mrb_pq_array_type(elementType) == 0) {
+    elementType = mrb_pq_infer_array_element_type(mrb, elements, nelements);
+  }
+
+  mrb_value str = mrb_str_buf_new(mrb, 20 + nelements * 12);
+  char header[20];
+  mrb_pq_write_uint32(header, 1);
+  mrb_pq_write_uint32(header + 4, 0);
+  mrb_pq_write_uint32(header + 8, elementType);
+  mrb_pq_write_uint32(header + 12, (uint32_t) nelements);
+  mrb_pq_write_uint32(header + 16, 1);
+  mrb_str_cat(mrb, str, header, sizeof(header));
+
+  mrb_bool has_null = FALSE;
+  char scratch[MRB_PQ_SCRATCH_SIZE];
+  for (mrb_int i = 0; i < nelements; i++) {
+    mrb_value element = elements[i];
+    const char *data;
+    Oid type;
+    int length, format;
+    if (mrb_nil_p(element)) {
+      has_null = TRUE;
+      mrb_pq_write_uint32(header, (uint32_t) -1);
+      mrb_str_cat(mrb, str, header, 4);
+      continue;
     }
-    if (likely(res)) {
-      return mrb_pq_result_processor(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result"), res);
+    switch (mrb_type(element)) {
+      case MRB_TT_FALSE:
+      case MRB_TT_TRUE: {
+        if (elementType != 16) {
+          mrb_raise(mrb, E_TYPE_ERROR, "array elements must all be of the same type");
+        }
+        scratch[0] = mrb_test(element) ? 1 : 0;
+        data = scratch;
+        length = 1;
+      } break;
+      case MRB_TT_INTEGER: {
+        data = mrb_pq_encode_integer(mrb, element, elementType, scratch, &type, &length, &format);
+        if (type != elementType || (format == 0 && elementType != 25 && elementType != 1043)) {
+          mrb_raise(mrb, E_TYPE_ERROR, "array elements must all be of the same type");
+        }
+      } break;
+#ifndef MRB_WITHOUT_FLOAT
+      case MRB_TT_FLOAT: {
+        data = mrb_pq_encode_float(mrb, element, elementType, scratch, &type, &length, &format);
+        if (type != elementType || (format == 0 && elementType != 25 && elementType != 1043)) {
+          mrb_raise(mrb, E_TYPE_ERROR, "array elements must all be of the same type");
+        }
+      } break;
+#endif
+      case MRB_TT_STRING: {
+        if (elementType != 25 && elementType != 1043) {
+          mrb_raise(mrb, E_TYPE_ERROR, "array elements must all be of the same type");
+        }
+        data = RSTRING_PTR(element);
+        length = (int) RSTRING_LEN(element);
+      } break;
+      default: {
+        if (!mrb_pq_time_p(mrb, element)) {
+          mrb_raisef(mrb, E_TYPE_ERROR, "cannot send %T as an array element", element);
+        }
+        data = mrb_pq_encode_time(mrb, element, elementType, scratch, &type, &length, &format);
+        if (type != elementType) {
+          mrb_raise(mrb, E_TYPE_ERROR, "array elements must all be of the same type");
+        }
+      }
+    }
+    mrb_pq_write_uint32(header, (uint32_t) length);
+    mrb_str_cat(mrb, str, header, 4);
+    mrb_str_cat(mrb, str, data, length);
+  }
+  if (has_null) {
+    mrb_pq_write_uint32(RSTRING_PTR(str) + 4, 1);
+  }
+
+  *paramType = mrb_pq_array_type(elementType);
+  *paramLength = (int) RSTRING_LEN(str);
+  *paramFormat = 1;
+  return RSTRING_PTR(str);
+}
+
+static const char *
+mrb_pq_encode_value(mrb_state *mrb, mrb_value types, mrb_value value, Oid declaredType, char *scratch, Oid *paramType, int *paramLength, int *paramFormat)
+{
+  switch(mrb_type(value)) {
+    case MRB_TT_FALSE: {
+      if (!mrb_integer(value)) {
+        *paramType = 0;
+        *paramLength = 0;
+        *paramFormat = 0;
+        return NULL;
+      } else {
+        *paramType = 16;
+        *paramLength = 1;
+        *paramFormat = 0;
+        return "f";
+      }
+    } break;
+    case MRB_TT_TRUE: {
+      *paramType = 16;
+      *paramLength = 1;
+      *paramFormat = 0;
+      return "t";
+    } break;
+    case MRB_TT_INTEGER: {
+      return mrb_pq_encode_integer(mrb, value, declaredType, scratch, paramType, paramLength, paramFormat);
+    } break;
+#ifndef MRB_WITHOUT_FLOAT
+    case MRB_TT_FLOAT: {
+      return mrb_pq_encode_float(mrb, value, declaredType, scratch, paramType, paramLength, paramFormat);
+    } break;
+#endif
+    case MRB_TT_ARRAY: {
+      return mrb_pq_encode_array(mrb, value, declaredType, paramType, paramLength, paramFormat);
+    } break;
+    default: {
+      if (!mrb_nil_p(types)) {
+        // [oid, proc] registered with Pq::TypeRegistry#register_encoder
+        mrb_value encoder = mrb_hash_get(mrb, mrb_iv_get(mrb, types, mrb_intern_lit(mrb, "@encoders")), mrb_obj_value(mrb_obj_class(mrb, value)));
+        if (mrb_array_p(encoder)) {
+          value = mrb_str_to_str(mrb, mrb_yield(mrb, RARRAY_PTR(encoder)[1], value));
+          *paramType = (Oid) mrb_integer(RARRAY_PTR(encoder)[0]);
+          *paramLength = RSTRING_LEN(value);
+          *paramFormat = 0;
+          return RSTRING_CSTR(mrb, value);
+        }
+      }
+      if (mrb_pq_time_p(mrb, value)) {
+        return mrb_pq_encode_time(mrb, value, declaredType, scratch, paramType, paramLength, paramFormat);
+      }
+      value = mrb_str_to_str(mrb, value);
+      *paramType = 0;
+      *paramLength = RSTRING_LEN(value);
+      *paramFormat = 1;
+      return RSTRING_PTR(value);
+    }
+  }
+}
+
+// encodes every parameter without allocating, only objects which have to be converted to a String create garbage
+static void
+mrb_pq_encode_params(mrb_state *mrb, mrb_value types, const mrb_value *paramValues_val, mrb_int nParams, const Oid *declaredTypes, char (*scratch)[MRB_PQ_SCRATCH_SIZE], Oid *paramTypes, const char **paramValues, int *paramLengths, int *paramFormats)
+{
+  for (mrb_int i = 0; i < nParams; i++) {
+    paramValues[i] = mrb_pq_encode_value(mrb, types, paramValues_val[i], declaredTypes ? declaredTypes[i] : 0, scratch[i], &paramTypes[i], &paramLengths[i], &paramFormats[i]);
+  }
+}
+
+static int
+mrb_pq_send_query_params(mrb_state *mrb, PGconn *conn, mrb_value types, const char *command, const mrb_value *paramValues_val, mrb_int nParams, int resultFormat)
+{
+  int success = FALSE;
+  if (nParams) {
+    Oid paramTypes[nParams];
+    const char *paramValues[nParams];
+    int paramLengths[nParams];
+    int paramFormats[nParams];
+    char scratch[nParams][MRB_PQ_SCRATCH_SIZE];
+    int arena_index = mrb_gc_arena_save(mrb);
+    mrb_pq_encode_params(mrb, types, paramValues_val, nParams, NULL, scratch, paramTypes, paramValues, paramLengths, paramFormats);
+    success = PQsendQueryParams(conn, command, nParams, paramTypes, paramValues, paramLengths, paramFormats, resultFormat);
+    mrb_gc_arena_restore(mrb, arena_index);
+  } else if (resultFormat) {
+    success = PQsendQueryParams(conn, command, 0, NULL, NULL, NULL, NULL, resultFormat);
+#ifdef LIBPQ_HAS_PIPELINING
+  } else if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF) {
+    // the simple query protocol isn't allowed in pipeline mode
+    success = PQsendQueryParams(conn, command, 0, NULL, NULL, NULL, NULL, 0);
+#endif
+  } else {
+    success = PQsendQuery(conn, command);
+  }
+
+  return success;
+}
+
+static int
+mrb_pq_send_query_prepared(mrb_state *mrb, PGconn *conn, mrb_value types, const char *stmtName, const mrb_value *paramValues_val, mrb_int nParams, int resultFormat)
+{
+  int success = FALSE;
+  if (nParams) {
+    Oid paramTypes[nParams];
+    const char *paramValues[nParams];
+    int paramLengths[nParams];
+    int paramFormats[nParams];
+    char scratch[nParams][MRB_PQ_SCRATCH_SIZE];
+    int arena_index = mrb_gc_arena_save(mrb);
+    mrb_pq_encode_params(mrb, types, paramValues_val, nParams, NULL, scratch, paramTypes, paramValues, paramLengths, paramFormats);
+    success = PQsendQueryPrepared(conn, stmtName, nParams, paramValues, paramLengths, paramFormats, resultFormat);
+    mrb_gc_arena_restore(mrb, arena_index);
+  } else {
+    success = PQsendQueryPrepared(conn, stmtName, nParams, NULL, NULL, NULL, resultFormat);
+  }
+
+  return success;
+}
+
+// literals become ?, runs of whitespace a single space, so queries which only differ in their constants share their stats
+static mrb_value
+mrb_pq_normalize_query(mrb_state *mrb, const char *query)
+{
+  size_t length = strlen(query);
+  mrb_value key = mrb_str_new(mrb, NULL, length);
+  const char *p = query, *end = query + length;
+  char *start = RSTRING_PTR(key), *q = start;
+
+  while (p < end) {
+    char c = *p;
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v') {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == '\f' || *p == '\v')) {
+        p++;
+      }
+      if (q > start) {
+        *q++ = ' ';
+      }
+    } else if (c == '\'') {
+      // backslashes only escape in E'' strings
+      mrb_bool escapes = q > start && (q[-1] == 'E' || q[-1] == 'e');
+      if (escapes) {
+        q--;
+      }
+      for (p++; p < end; p++) {
+        if (escapes && *p == '\\' && p + 1 < end) {
+          p++;
+        } else if (*p == '\'') {
+          if (p + 1 < end && p[1] == '\'') {
+            p++;
+          } else {
+            p++;
+            break;
+          }
+        }
+      }
+      *q++ = '?';
+    } else if (c >= '0' && c <= '9' && (q == start || !(isalnum((unsigned char) q[-1]) || q[-1] == '_' || q[-1] == '$'))) {
+      while (p < end && (isalnum((unsigned char) *p) || *p == '.')) {
+        p++;
+      }
+      *q++ = '?';
+    } else if (c == '"') {
+      // quoted identifiers are kept as they are
+      do {
+        *q++ = *p++;
+      } while (p < end && *p != '"');
+      if (p < end) {
+        *q++ = *p++;
+      }
+    } else {
+      *q++ = *p++;
+    }
+  }
+  if (q > start && q[-1] == ' ') {
+    q--;
+  }
+  mrb_str_resize(mrb, key, q - start);
+
+  return key;
+}
+
+// statements and queries tracked per connection, the least recently used one is dropped to make room for a new one
+#ifndef MRB_PQ_STATS_QUERIES
+#define MRB_PQ_STATS_QUERIES 1000
+#endif
+
+// the Pq::QueryStats of a statement name or query, nil unless the connection collects stats
+static mrb_value
+mrb_pq_query_stats_for(mrb_state *mrb, mrb_value self, const char *stmt_name, const char *query)
+{
+  mrb_value stats = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@stats"));
+  if (likely(!mrb_hash_p(stats))) {
+    return mrb_nil_value();
+  }
+
+  mrb_value key = stmt_name ? mrb_str_new_cstr(mrb, stmt_name) : mrb_pq_normalize_query(mrb, query);
+  // moved to the end on every call, so the first entry is always the least recently used one
+  mrb_value query_stats = mrb_hash_delete_key(mrb, stats, key);
+  if (!mrb_nil_p(query_stats)) {
+    mrb_gc_protect(mrb, query_stats);
+  } else {
+    if (mrb_hash_size(mrb, stats) >= MRB_PQ_STATS_QUERIES) {
+      mrb_funcall(mrb, stats, "shift", 0);
+    }
+    struct RClass *query_stats_class = mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "QueryStats");
+    query_stats = mrb_obj_value(mrb_data_object_alloc(mrb, query_stats_class, NULL, &mrb_pq_query_stats_type));
+    mrb_data_init(query_stats, mrb_calloc(mrb, 1, sizeof(mrb_pq_query_stats)), &mrb_pq_query_stats_type);
+  }
+  mrb_hash_set(mrb, stats, key, query_stats);
+
+  return query_stats;
+}
+
+static inline mrb_pq_query_stats *
+mrb_pq_query_stats_ptr(mrb_value query_stats)
+{
+  return mrb_nil_p(query_stats) ? NULL : (mrb_pq_query_stats *) DATA_PTR(query_stats);
+}
+
+static int
+mrb_pq_latency_bucket(uint64_t usec)
+{
+  if (usec < 8) {
+    return (int) usec;
+  }
+  int exponent = 63 - __builtin_clzll(usec);
+  int bucket = 8 + (exponent - 3) * 8 + (int) ((usec >> (exponent - 3)) & 7);
+  return bucket < MRB_PQ_LATENCY_BUCKETS ? bucket : MRB_PQ_LATENCY_BUCKETS - 1;
+}
+
+// the largest value which falls into the bucket
+static uint64_t
+mrb_pq_latency_bucket_max(int bucket)
+{
+  if (bucket < 8) {
+    return (uint64_t) bucket;
+  }
+  int exponent = (bucket - 8) / 8 + 3;
+  uint64_t mantissa = 8 + (uint64_t) ((bucket - 8) % 8);
+  return ((mantissa + 1) << (exponent - 3)) - 1;
+}
+
+static void
+mrb_pq_query_stats_add_result(mrb_pq_query_stats *stats, const PGresult *res)
+{
+  stats->rows += (uint64_t) PQntuples(res);
+  stats->bytes += (uint64_t) PQresultMemorySize(res);
+}
+
+// one call of a query, wait_ns is all the time spent waiting for its results
+static void
+mrb_pq_query_stats_add_call(mrb_pq_query_stats *stats, uint64_t encode_ns, uint64_t wait_ns)
+{
+  uint64_t usec = wait_ns / 1000;
+  stats->calls++;
+  stats->encode_ns += encode_ns;
+  stats->wait_ns += wait_ns;
+  stats->latency[mrb_pq_latency_bucket(usec)]++;
+  if (usec > stats->max_latency_us) {
+    stats->max_latency_us = usec;
+  }
+}
+
+// PQtrace output is kept as the last limit lines in memory, each cut to MRB_PQ_TRACE_LINE bytes, so tracing can stay on
+#define MRB_PQ_TRACE_LINE 512
+
+// owned by the connection through a libpq event proc, which closes it when the connection is finished
+typedef struct {
+  FILE *file;
+  char *lines; // limit + 1 slots, the one at head is being written, NULL when tracing into a file
+  size_t *lengths;
+  size_t limit, head, count, current;
+  size_t attach; // the number of lines attached to errors
+} mrb_pq_trace;
+
+static void
+mrb_pq_trace_free(mrb_pq_trace *trace)
+{
+  free(trace->lines);
+  free(trace->lengths);
+  free(trace);
+}
+
+// called by libpq, so it must not raise
+static ssize_t
+mrb_pq_trace_write(void *cookie, const char *buf, size_t size)
+{
+  mrb_pq_trace *trace = (mrb_pq_trace *) cookie;
+  const char *p = buf, *end = buf + size;
+  while (p < end) {
+    char *slot = trace->lines + trace->head * MRB_PQ_TRACE_LINE;
+#ifndef LIBPQ_HAS_TRACE_FLAGS
+    // only the newer trace format has timestamps of its own
+    if (trace->current == 0) {
+      struct timespec ts;
+      struct tm tm;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      localtime_r(&ts.tv_sec, &tm);
+      size_t length = strftime(slot, MRB_PQ_TRACE_LINE, "%Y-%m-%d %H:%M:%S", &tm);
+      trace->current = length + snprintf(slot + length, MRB_PQ_TRACE_LINE - length, ".%06ld\t", (long) (ts.tv_nsec / 1000));
+    }
+#endif
+    const char *newline = (const char *) memchr(p, '\n', end - p);
+    size_t length = (newline ? newline : end) - p;
+    size_t room = MRB_PQ_TRACE_LINE - trace->current;
+    if (length > room) {
+      memcpy(slot + trace->current, p, room);
+      memcpy(slot + MRB_PQ_TRACE_LINE - 3, "...", 3);
+      trace->current = MRB_PQ_TRACE_LINE;
+    } else {
+      memcpy(slot + trace->current, p, length);
+      trace->current += length;
+    }
+    if (!newline) {
+      break;
+    }
+    trace->lengths[trace->head] = trace->current;
+    trace->head = (trace->head + 1) % (trace->limit + 1);
+    if (trace->count < trace->limit) {
+      trace->count++;
+    }
+    trace->current = 0;
+    p = newline + 1;
+  }
+
+  return (ssize_t) size;
+}
+
+static int
+mrb_pq_trace_close(void *cookie)
+{
+  mrb_pq_trace_free((mrb_pq_trace *) cookie);
+  return 0;
+}
+
+#if defined(__GLIBC__)
+static FILE *
+mrb_pq_trace_open(mrb_pq_trace *trace)
+{
+  cookie_io_functions_t functions = { NULL, mrb_pq_trace_write, NULL, mrb_pq_trace_close };
+  return fopencookie(trace, "w", functions);
+}
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+static int
+mrb_pq_trace_funopen_write(void *cookie, const char *buf, int size)
+{
+  return (int) mrb_pq_trace_write(cookie, buf, (size_t) size);
+}
+
+static FILE *
+mrb_pq_trace_open(mrb_pq_trace *trace)
+{
+  return funopen(trace, NULL, mrb_pq_trace_funopen_write, NULL, mrb_pq_trace_close);
+}
+#else
+static FILE *
+mrb_pq_trace_open(mrb_pq_trace *trace)
+{
+  errno = ENOTSUP;
+  return NULL;
+}
+#endif
+
+// a ring buffer is freed by the close function of its FILE
+static void
+mrb_pq_trace_close_file(mrb_pq_trace *trace)
+{
+  // trace is gone after fclose when the FILE owns it
+  mrb_bool owned_by_file = trace->lines != NULL;
+  fclose(trace->file);
+  if (!owned_by_file) {
+    mrb_pq_trace_free(trace);
+  }
+}
+
+static int
+mrb_pq_trace_event(PGEventId id, void *info, void *pass_through)
+{
+  if (id == PGEVT_CONNDESTROY) {
+    PGconn *conn = ((PGEventConnDestroy *) info)->conn;
+    mrb_pq_trace *trace = (mrb_pq_trace *) PQinstanceData(conn, mrb_pq_trace_event);
+    if (trace) {
+      PQuntrace(conn);
+      mrb_pq_trace_close_file(trace);
+    }
+  }
+
+  return TRUE;
+}
+
+static void
+mrb_pq_untrace(PGconn *conn)
+{
+  mrb_pq_trace *trace = (mrb_pq_trace *) PQinstanceData(conn, mrb_pq_trace_event);
+  PQuntrace(conn);
+  if (trace) {
+    PQsetInstanceData(conn, mrb_pq_trace_event, NULL);
+    mrb_pq_trace_close_file(trace);
+  }
+}
+
+// the last n lines of the ring buffer, oldest first
+static mrb_value
+mrb_pq_trace_lines(mrb_state *mrb, const mrb_pq_trace *trace, size_t n)
+{
+  if (!trace || !trace->lines) {
+    return mrb_ary_new(mrb);
+  }
+  fflush(trace->file);
+  if (n > trace->count) {
+    n = trace->count;
+  }
+  mrb_value lines = mrb_ary_new_capa(mrb, (mrb_int) n);
+  size_t slots = trace->limit + 1;
+  for (size_t i = n; i > 0; i--) {
+    size_t slot = (trace->head + slots - i) % slots;
+    mrb_ary_push(mrb, lines, mrb_str_new(mrb, trace->lines + slot * MRB_PQ_TRACE_LINE, trace->lengths[slot]));
+  }
+
+  return lines;
+}
+
+static void
+mrb_pq_trace_attach(mrb_state *mrb, mrb_value error, PGconn *conn)
+{
+  const mrb_pq_trace *trace = (const mrb_pq_trace *) PQinstanceData(conn, mrb_pq_trace_event);
+  if (trace && trace->lines && trace->attach) {
+    mrb_iv_set(mrb, error, mrb_intern_lit(mrb, "@trace"), mrb_pq_trace_lines(mrb, trace, trace->attach));
+  }
+}
+
+// target is the number of lines to keep in memory or the path of a file to append to
+static mrb_value
+mrb_PQtrace(mrb_state *mrb, mrb_value self)
+{
+  mrb_value target;
+  mrb_int attach = 0;
+  mrb_get_args(mrb, "o|i", &target, &attach);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  mrb_int limit = 0;
+  const char *path = NULL;
+  if (mrb_string_p(target)) {
+    path = mrb_string_value_cstr(mrb, &target);
+  } else {
+    limit = mrb_as_int(mrb, target);
+    if (limit < 1 || (size_t) limit > SIZE_MAX / MRB_PQ_TRACE_LINE - 1) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "the trace limit must be a positive Integer");
+    }
+  }
+  if (attach < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "the number of lines attached to errors can't be negative");
+  }
+
+  mrb_pq_untrace(conn);
+  mrb_pq_trace *trace = (mrb_pq_trace *) calloc(1, sizeof(mrb_pq_trace));
+  if (unlikely(!trace)) {
+    mrb_sys_fail(mrb, "calloc");
+  }
+  errno = 0;
+  if (path) {
+    trace->file = fopen(path, "a");
+  } else {
+    trace->limit = (size_t) limit;
+    trace->attach = (size_t) attach < trace->limit ? (size_t) attach : trace->limit;
+    trace->lines = (char *) malloc((trace->limit + 1) * MRB_PQ_TRACE_LINE);
+    trace->lengths = (size_t *) calloc(trace->limit + 1, sizeof(size_t));
+    if (likely(trace->lines && trace->lengths)) {
+      trace->file = mrb_pq_trace_open(trace);
+    }
+  }
+  if (unlikely(!trace->file)) {
+    mrb_pq_trace_free(trace);
+    mrb_sys_fail(mrb, path ? path : "PQtrace");
+  }
+  setvbuf(trace->file, NULL, _IOLBF, 0);
+
+  // fails when the event proc is already registered from an earlier trace, which is fine
+  PQregisterEventProc(conn, mrb_pq_trace_event, "mruby-postgresql trace", NULL);
+  if (unlikely(!PQsetInstanceData(conn, mrb_pq_trace_event, trace))) {
+    mrb_pq_trace_close_file(trace);
+    mrb_raise(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Error"), "can't attach the trace to the connection");
+  }
+  PQtrace(conn, trace->file);
+
+  return self;
+}
+
+static mrb_value
+mrb_PQuntrace(mrb_state *mrb, mrb_value self)
+{
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+  mrb_pq_untrace(conn);
+
+  return self;
+}
+
+static mrb_value
+mrb_pq_trace_messages(mrb_state *mrb, mrb_value self)
+{
+  mrb_value n = mrb_nil_value();
+  mrb_get_args(mrb, "|o", &n);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+  const mrb_pq_trace *trace = (const mrb_pq_trace *) PQinstanceData(conn, mrb_pq_trace_event);
+  mrb_int count = mrb_nil_p(n) ? MRB_INT_MAX : mrb_as_int(mrb, n);
+  if (count < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "negative number of messages");
+  }
+
+  return mrb_pq_trace_lines(mrb, trace, (size_t) count);
+}
+
+#ifdef LIBPQ_HAS_TRACE_FLAGS
+static mrb_value
+mrb_PQsetTraceFlags(mrb_state *mrb, mrb_value self)
+{
+  mrb_int flags;
+  mrb_get_args(mrb, "i", &flags);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+  PQsetTraceFlags(conn, (int) flags);
+
+  return mrb_int_value(mrb, flags);
+}
+#endif
+
+// the statuses which are returned as a Pq::Result::Error
+static mrb_bool
+mrb_pq_result_error_p(const PGresult *res)
+{
+  switch (PQresultStatus(res)) {
+    case PGRES_EMPTY_QUERY:
+    case PGRES_BAD_RESPONSE:
+    case PGRES_NONFATAL_ERROR:
+    case PGRES_FATAL_ERROR:
+#ifdef LIBPQ_HAS_PIPELINING
+    case PGRES_PIPELINE_ABORTED:
+#endif
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+// results which are decoded later add their decoding time to the stats of their query
+static void
+mrb_pq_result_set_stats(mrb_state *mrb, mrb_value result, mrb_value query_stats)
+{
+  if (!mrb_nil_p(query_stats) && !mrb_pq_result_error_p((const PGresult *) DATA_PTR(result))) {
+    mrb_iv_set(mrb, result, mrb_intern_lit(mrb, "@stats"), query_stats);
+  }
+}
+
+static mrb_value
+mrb_pq_query_stats_percentile(mrb_state *mrb, const mrb_pq_query_stats *stats, double percentile)
+{
+  uint64_t rank = (uint64_t) ceil((double) stats->calls * percentile);
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < MRB_PQ_LATENCY_BUCKETS; bucket++) {
+    seen += stats->latency[bucket];
+    if (seen >= rank && seen > 0) {
+      uint64_t usec = mrb_pq_latency_bucket_max(bucket);
+      return mrb_int_value(mrb, (mrb_int) (usec < stats->max_latency_us ? usec : stats->max_latency_us));
+    }
+  }
+
+  return mrb_int_value(mrb, 0);
+}
+
+static mrb_value
+mrb_pq_query_stats_to_h(mrb_state *mrb, mrb_value self)
+{
+  const mrb_pq_query_stats *stats = DATA_GET_PTR(mrb, self, &mrb_pq_query_stats_type, mrb_pq_query_stats);
+  mrb_value latency = mrb_hash_new_capa(mrb, 5);
+  mrb_hash_set(mrb, latency, mrb_symbol_value(mrb_intern_lit(mrb, "p50")), mrb_pq_query_stats_percentile(mrb, stats, 0.5));
+  mrb_hash_set(mrb, latency, mrb_symbol_value(mrb_intern_lit(mrb, "p90")), mrb_pq_query_stats_percentile(mrb, stats, 0.9));
+  mrb_hash_set(mrb, latency, mrb_symbol_value(mrb_intern_lit(mrb, "p99")), mrb_pq_query_stats_percentile(mrb, stats, 0.99));
+  mrb_hash_set(mrb, latency, mrb_symbol_value(mrb_intern_lit(mrb, "p999")), mrb_pq_query_stats_percentile(mrb, stats, 0.999));
+  mrb_hash_set(mrb, latency, mrb_symbol_value(mrb_intern_lit(mrb, "max")), mrb_int_value(mrb, (mrb_int) stats->max_latency_us));
+
+  mrb_value hash = mrb_hash_new_capa(mrb, 7);
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "calls")), mrb_int_value(mrb, (mrb_int) stats->calls));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "rows")), mrb_int_value(mrb, (mrb_int) stats->rows));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "bytes")), mrb_int_value(mrb, (mrb_int) stats->bytes));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "wait_us")), mrb_int_value(mrb, (mrb_int) (stats->wait_ns / 1000)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "encode_us")), mrb_int_value(mrb, (mrb_int) (stats->encode_ns / 1000)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "decode_us")), mrb_int_value(mrb, (mrb_int) (stats->decode_ns / 1000)));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "latency_us")), latency);
+
+  return hash;
+}
+
+// the raw histogram, [largest microseconds of the bucket, count] for every bucket which isn't empty
+static mrb_value
+mrb_pq_query_stats_histogram(mrb_state *mrb, mrb_value self)
+{
+  const mrb_pq_query_stats *stats = DATA_GET_PTR(mrb, self, &mrb_pq_query_stats_type, mrb_pq_query_stats);
+  mrb_value histogram = mrb_ary_new(mrb);
+  for (int bucket = 0; bucket < MRB_PQ_LATENCY_BUCKETS; bucket++) {
+    if (stats->latency[bucket]) {
+      mrb_value pair[2] = { mrb_int_value(mrb, (mrb_int) mrb_pq_latency_bucket_max(bucket)), mrb_int_value(mrb, (mrb_int) stats->latency[bucket]) };
+      mrb_ary_push(mrb, histogram, mrb_ary_new_from_values(mrb, 2, pair));
+    }
+  }
+
+  return histogram;
+}
+
+// self is the connection which returned the result, nil for results passed to the notice receiver
+static mrb_value
+mrb_pq_result_processor(mrb_state *mrb, struct RClass *pq_result_class, mrb_value self, PGresult *res)
+{
+  struct mrb_jmpbuf* prev_jmp = mrb->jmp;
+  struct mrb_jmpbuf c_jmp;
+  mrb_value return_val;
+
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    switch(PQresultStatus(res)) {
+      case PGRES_EMPTY_QUERY: {
+        return_val = mrb_exc_new_str(mrb, mrb_class_get_under(mrb, pq_result_class, "EmptyQueryError"), mrb_str_new_cstr(mrb, PQresultErrorMessage(res)));
+      } break;
+      case PGRES_BAD_RESPONSE: {
+        return_val = mrb_exc_new_str(mrb, mrb_class_get_under(mrb, pq_result_class, "BadResponseError"), mrb_str_new_cstr(mrb, PQresultErrorMessage(res)));
+      } break;
+      case PGRES_NONFATAL_ERROR: {
+        return_val = mrb_exc_new_str(mrb, mrb_class_get_under(mrb, pq_result_class, "NonFatalError"), mrb_str_new_cstr(mrb, PQresultErrorMessage(res)));
+      } break;
+      case PGRES_FATAL_ERROR: {
+        return_val = mrb_exc_new_str(mrb, mrb_class_get_under(mrb, pq_result_class, "FatalError"), mrb_str_new_cstr(mrb, PQresultErrorMessage(res)));
+      } break;
+#ifdef LIBPQ_HAS_PIPELINING
+      case PGRES_PIPELINE_ABORTED: {
+        return_val = mrb_exc_new_str(mrb, mrb_class_get_under(mrb, pq_result_class, "PipelineAbortedError"), mrb_str_new_lit(mrb, "pipeline aborted by an earlier error"));
+      } break;
+#endif
+      default: {
+        return_val = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_DATA, pq_result_class));
+        mrb_iv_set(mrb, return_val, mrb_intern_lit(mrb, "@status"), mrb_int_value(mrb, PQresultStatus(res)));
+        mrb_value types = mrb_nil_p(self) ? mrb_nil_value() : mrb_pq_types(mrb, self);
+        if (!mrb_nil_p(types)) {
+          mrb_iv_set(mrb, return_val, mrb_intern_lit(mrb, "@types"), types);
+        }
+      }
+    }
+    if (mrb_pq_result_error_p(res) && !mrb_nil_p(self)) {
+      mrb_pq_trace_attach(mrb, return_val, (PGconn *) DATA_PTR(self));
+    }
+    mrb_data_init(return_val, res, &mrb_PGresult_type);
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    PQclear(res);
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+
+  return return_val;
+}
+
+// records a call which returned a single result and wraps the result like mrb_pq_result_processor
+static mrb_value
+mrb_pq_stats_result(mrb_state *mrb, struct RClass *pq_result_class, mrb_value self, PGresult *res, mrb_value query_stats, uint64_t encode_ns, uint64_t wait_ns)
+{
+  mrb_pq_query_stats *stats = mrb_pq_query_stats_ptr(query_stats);
+  if (stats) {
+    mrb_pq_query_stats_add_result(stats, res);
+    mrb_pq_query_stats_add_call(stats, encode_ns, wait_ns);
+  }
+  mrb_value result = mrb_pq_result_processor(mrb, pq_result_class, self, res);
+  mrb_pq_result_set_stats(mrb, result, query_stats);
+
+  return result;
+}
+
+static mrb_value
+mrb_pq_consume_each_row(mrb_state *mrb, mrb_value self, PGconn *conn, mrb_value block, mrb_value query_stats, uint64_t encode_ns, double deadline)
+{
+  int arena_index = mrb_gc_arena_save(mrb);
+  struct mrb_jmpbuf* prev_jmp = mrb->jmp;
+  struct RClass *pq_result_class = mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result");
+  struct mrb_jmpbuf c_jmp;
+
+#ifdef LIBPQ_HAS_CHUNK_MODE
+  int chunk_size = mrb_pq_chunk_size(mrb, self);
+  if (chunk_size > 1) {
+    PQsetChunkedRowsMode(conn, chunk_size);
+  } else {
+    PQsetSingleRowMode(conn);
+  }
+#else
+  PQsetSingleRowMode(conn);
+#endif
+  mrb_pq_query_stats *stats = mrb_pq_query_stats_ptr(query_stats);
+  uint64_t wait_ns = 0, started = stats ? mrb_pq_clock_ns() : 0;
+  PGresult *res = mrb_pq_get_result_until(mrb, self, conn, deadline, NULL);
+  if (stats) {
+    wait_ns += mrb_pq_clock_ns() - started;
+  }
+  mrb_sym cancel = mrb_intern_lit(mrb, "cancel");
+
+  MRB_TRY(&c_jmp)
+  {
+    mrb->jmp = &c_jmp;
+    while (res) {
+      if (stats) {
+        mrb_pq_query_stats_add_result(stats, res);
+      }
+      mrb_value result = mrb_pq_result_processor(mrb, pq_result_class, self, res);
+      mrb_pq_result_set_stats(mrb, result, query_stats);
+      mrb_value ret = mrb_yield(mrb, block, result);
+      mrb_gc_arena_restore(mrb, arena_index);
+      if (mrb_symbol_p(ret) && mrb_symbol(ret) == cancel) {
+        while ((res = mrb_pq_get_result_until(mrb, self, conn, deadline, NULL))) {
+          PQclear(res);
+        }
+        break;
+      }
+      if (stats) {
+        started = mrb_pq_clock_ns();
+      }
+      res = mrb_pq_get_result_until(mrb, self, conn, deadline, NULL);
+      if (stats) {
+        wait_ns += mrb_pq_clock_ns() - started;
+      }
+    }
+    if (stats) {
+      mrb_pq_query_stats_add_call(stats, encode_ns, wait_ns);
+    }
+    mrb->jmp = prev_jmp;
+  }
+  MRB_CATCH(&c_jmp)
+  {
+    mrb->jmp = prev_jmp;
+    // a deadline which passed already canceled the query
+    if (PQtransactionStatus(conn) == PQTRANS_ACTIVE) {
+      mrb_pq_cancel_and_drain(conn);
+    }
+    MRB_THROW(mrb->jmp);
+  }
+  MRB_END_EXC(&c_jmp);
+
+  return self;
+}
+
+static mrb_value
+mrb_pq_exec_cached(mrb_state *mrb, mrb_value self, PGconn *conn, mrb_value statement_cache, const char *command, const mrb_value *paramValues_val, mrb_int nParams, mrb_value block, double deadline)
+{
+  struct RClass *pq_result_class = mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result");
+  int resultFormat = mrb_pq_result_format(mrb, self);
+  Oid paramTypes[nParams];
+  const char *paramValues[nParams];
+  int paramLengths[nParams];
+  int paramFormats[nParams];
+  char scratch[nParams][MRB_PQ_SCRATCH_SIZE];
+  int arena_index = mrb_gc_arena_save(mrb);
+  mrb_value query_stats = mrb_pq_query_stats_for(mrb, self, NULL, command);
+  mrb_pq_query_stats *stats = mrb_pq_query_stats_ptr(query_stats);
+  uint64_t encode_ns = 0, wait_ns = 0, started = stats ? mrb_pq_clock_ns() : 0;
+  mrb_pq_encode_params(mrb, mrb_pq_types(mrb, self), paramValues_val, nParams, NULL, scratch, paramTypes, paramValues, paramLengths, paramFormats);
+  if (stats) {
+    encode_ns = mrb_pq_clock_ns() - started;
+  }
+
+  // the same query text can be sent with differently typed arguments, each combination gets its own statement
+  mrb_value key = mrb_str_new_cstr(mrb, command);
+  mrb_str_cat(mrb, key, (const char *) paramTypes, sizeof(paramTypes));
+  mrb_value stmt_name = mrb_funcall(mrb, statement_cache, "fetch", 1, key);
+  if (mrb_nil_p(stmt_name)) {
+    stmt_name = mrb_funcall(mrb, statement_cache, "store", 1, key);
+    errno = 0;
+    started = stats ? mrb_pq_clock_ns() : 0;
+    PGresult *res = NULL;
+    if (deadline < 0) {
+      res = PQprepare(conn, RSTRING_CSTR(mrb, stmt_name), command, nParams, paramTypes);
+    } else {
+      struct mrb_jmpbuf* prev_jmp = mrb->jmp;
+      struct mrb_jmpbuf c_jmp;
+      MRB_TRY(&c_jmp)
+      {
+        mrb->jmp = &c_jmp;
+        res = mrb_pq_exec_sent(mrb, self, conn, PQsendPrepare(conn, RSTRING_CSTR(mrb, stmt_name), command, nParams, paramTypes), deadline);
+        mrb->jmp = prev_jmp;
+      }
+      MRB_CATCH(&c_jmp)
+      {
+        mrb->jmp = prev_jmp;
+        mrb_funcall(mrb, statement_cache, "delete", 1, key);
+        mrb_gc_arena_restore(mrb, arena_index);
+        MRB_THROW(mrb->jmp);
+      }
+      MRB_END_EXC(&c_jmp);
+    }
+    if (stats) {
+      wait_ns = mrb_pq_clock_ns() - started;
+    }
+    if (unlikely(!res)) {
+      mrb_funcall(mrb, statement_cache, "delete", 1, key);
+      mrb_gc_arena_restore(mrb, arena_index);
+      mrb_pq_handle_connection_error(mrb, self, conn);
+    }
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      mrb_funcall(mrb, statement_cache, "delete", 1, key);
+      mrb_gc_arena_restore(mrb, arena_index);
+      if (stats) {
+        mrb_pq_query_stats_add_call(stats, encode_ns, wait_ns);
+      }
+      return mrb_pq_result_processor(mrb, pq_result_class, self, res);
+    }
+    PQclear(res);
+  }
+
+  errno = 0;
+  if (mrb_type(block) == MRB_TT_PROC) {
+    int success = PQsendQueryPrepared(conn, RSTRING_CSTR(mrb, stmt_name), nParams, paramValues, paramLengths, paramFormats, resultFormat);
+    mrb_gc_arena_restore(mrb, arena_index);
+    if (likely(success)) {
+      return mrb_pq_consume_each_row(mrb, self, conn, block, query_stats, encode_ns, deadline);
+    } else {
+      mrb_pq_handle_connection_error(mrb, self, conn);
+    }
+  } else {
+    started = stats ? mrb_pq_clock_ns() : 0;
+    PGresult *res = deadline < 0 ? PQexecPrepared(conn, RSTRING_CSTR(mrb, stmt_name), nParams, paramValues, paramLengths, paramFormats, resultFormat)
+      : mrb_pq_exec_sent(mrb, self, conn, PQsendQueryPrepared(conn, RSTRING_CSTR(mrb, stmt_name), nParams, paramValues, paramLengths, paramFormats, resultFormat), deadline);
+    mrb_gc_arena_restore(mrb, arena_index);
+    if (likely(res)) {
+      return mrb_pq_stats_result(mrb, pq_result_class, self, res, query_stats, encode_ns, wait_ns + (stats ? mrb_pq_clock_ns() - started : 0));
+    } else {
+      mrb_sys_fail(mrb, PQresultErrorMessage(res));
+    }
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQexec(mrb_state *mrb, mrb_value self)
+{
+  const char *command;
+  mrb_value *paramValues_val = NULL;
+  mrb_int nParams = 0;
+  mrb_value block = mrb_nil_value();
+  MRB_PQ_DEADLINE_KWARGS(kwargs, kw_values);
+  mrb_get_args(mrb, "z|*:&", &command, &paramValues_val, &nParams, &kwargs, &block);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+  double deadline = mrb_pq_query_deadline(mrb, self, kw_values);
+
+  if (nParams) {
+    mrb_value statement_cache = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@statement_cache"));
+    if (!mrb_nil_p(statement_cache)) {
+      return mrb_pq_exec_cached(mrb, self, conn, statement_cache, command, paramValues_val, nParams, block, deadline);
+    }
+  }
+
+  mrb_value query_stats = mrb_pq_query_stats_for(mrb, self, NULL, command);
+  mrb_pq_query_stats *stats = mrb_pq_query_stats_ptr(query_stats);
+  uint64_t encode_ns = 0, started = stats ? mrb_pq_clock_ns() : 0;
+  errno = 0;
+  if (mrb_type(block) == MRB_TT_PROC) {
+    int success = mrb_pq_send_query_params(mrb, conn, mrb_pq_types(mrb, self), command, paramValues_val, nParams, mrb_pq_result_format(mrb, self));
+    if (stats) {
+      encode_ns = mrb_pq_clock_ns() - started;
+    }
+    if (likely(success)) {
+      return mrb_pq_consume_each_row(mrb, self, conn, block, query_stats, encode_ns, deadline);
+    } else {
+      mrb_pq_handle_connection_error(mrb, self, conn);
+    }
+  } else {
+    PGresult *res = NULL;
+    int resultFormat = mrb_pq_result_format(mrb, self);
+    if (nParams) {
+      Oid paramTypes[nParams];
+      const char *paramValues[nParams];
+      int paramLengths[nParams];
+      int paramFormats[nParams];
+      char scratch[nParams][MRB_PQ_SCRATCH_SIZE];
+      int arena_index = mrb_gc_arena_save(mrb);
+      mrb_pq_encode_params(mrb, mrb_pq_types(mrb, self), paramValues_val, nParams, NULL, scratch, paramTypes, paramValues, paramLengths, paramFormats);
+      if (stats) {
+        uint64_t encoded = mrb_pq_clock_ns();
+        encode_ns = encoded - started;
+        started = encoded;
+      }
+      res = deadline < 0 ? PQexecParams(conn, command, nParams, paramTypes, paramValues, paramLengths, paramFormats, resultFormat)
+        : mrb_pq_exec_sent(mrb, self, conn, PQsendQueryParams(conn, command, nParams, paramTypes, paramValues, paramLengths, paramFormats, resultFormat), deadline);
+      mrb_gc_arena_restore(mrb, arena_index);
+    } else if (resultFormat) {
+      res = deadline < 0 ? PQexecParams(conn, command, 0, NULL, NULL, NULL, NULL, resultFormat)
+        : mrb_pq_exec_sent(mrb, self, conn, PQsendQueryParams(conn, command, 0, NULL, NULL, NULL, NULL, resultFormat), deadline);
+    } else {
+      res = deadline < 0 ? PQexec(conn, command) : mrb_pq_exec_sent(mrb, self, conn, PQsendQuery(conn, command), deadline);
+    }
+    if (likely(res)) {
+      return mrb_pq_stats_result(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result"), self, res, query_stats, encode_ns, stats ? mrb_pq_clock_ns() - started : 0);
+    } else {
+      mrb_sys_fail(mrb, PQresultErrorMessage(res));
+    }
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQprepare(mrb_state *mrb, mrb_value self)
+{
+  const char *stmtName, *query;
+  mrb_get_args(mrb, "zz", &stmtName, &query);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  PGresult *res = PQprepare(conn, stmtName, query, 0, NULL);
+  if (likely(res)) {
+    return mrb_pq_result_processor(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result"), self, res);
+  } else {
+    mrb_sys_fail(mrb, PQresultErrorMessage(res));
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_pq_exec_prepared(mrb_state *mrb, mrb_value self, PGconn *conn, const char *stmtName, const Oid *declaredTypes, const mrb_value *paramValues_val, mrb_int nParams, mrb_value block, double deadline)
+{
+  int resultFormat = mrb_pq_result_format(mrb, self);
+  int success = FALSE;
+  PGresult *res = NULL;
+  mrb_value query_stats = mrb_pq_query_stats_for(mrb, self, stmtName, NULL);
+  mrb_pq_query_stats *stats = mrb_pq_query_stats_ptr(query_stats);
+  uint64_t encode_ns = 0, started = stats ? mrb_pq_clock_ns() : 0;
+
+  errno = 0;
+  if (nParams) {
+    const char *paramValues[nParams];
+    Oid paramTypes[nParams];
+    int paramLengths[nParams];
+    int paramFormats[nParams];
+    char scratch[nParams][MRB_PQ_SCRATCH_SIZE];
+    int arena_index = mrb_gc_arena_save(mrb);
+    mrb_pq_encode_params(mrb, mrb_pq_types(mrb, self), paramValues_val, nParams, declaredTypes, scratch, paramTypes, paramValues, paramLengths, paramFormats);
+    if (stats) {
+      uint64_t encoded = mrb_pq_clock_ns();
+      encode_ns = encoded - started;
+      started = encoded;
+    }
+    if (mrb_type(block) == MRB_TT_PROC) {
+      success = PQsendQueryPrepared(conn, stmtName, nParams, paramValues, paramLengths, paramFormats, resultFormat);
+    } else if (deadline < 0) {
+      res = PQexecPrepared(conn, stmtName, nParams, paramValues, paramLengths, paramFormats, resultFormat);
+    } else {
+      res = mrb_pq_exec_sent(mrb, self, conn, PQsendQueryPrepared(conn, stmtName, nParams, paramValues, paramLengths, paramFormats, resultFormat), deadline);
+    }
+    mrb_gc_arena_restore(mrb, arena_index);
+  } else if (mrb_type(block) == MRB_TT_PROC) {
+    success = PQsendQueryPrepared(conn, stmtName, nParams, NULL, NULL, NULL, resultFormat);
+  } else if (deadline < 0) {
+    res = PQexecPrepared(conn, stmtName, nParams, NULL, NULL, NULL, resultFormat);
+  } else {
+    res = mrb_pq_exec_sent(mrb, self, conn, PQsendQueryPrepared(conn, stmtName, nParams, NULL, NULL, NULL, resultFormat), deadline);
+  }
+
+  if (mrb_type(block) == MRB_TT_PROC) {
+    if (likely(success)) {
+      return mrb_pq_consume_each_row(mrb, self, conn, block, query_stats, encode_ns, deadline);
+    } else {
+      mrb_pq_handle_connection_error(mrb, self, conn);
+    }
+  } else {
+    if (likely(res)) {
+      return mrb_pq_stats_result(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result"), self, res, query_stats, encode_ns, stats ? mrb_pq_clock_ns() - started : 0);
+    } else {
+      mrb_sys_fail(mrb, PQresultErrorMessage(res));
+    }
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQexecPrepared(mrb_state *mrb, mrb_value self)
+{
+  const char *stmtName;
+  mrb_value *paramValues_val = NULL;
+  mrb_int nParams = 0;
+  mrb_value block = mrb_nil_value();
+  MRB_PQ_DEADLINE_KWARGS(kwargs, kw_values);
+  mrb_get_args(mrb, "z|*:&", &stmtName, &paramValues_val, &nParams, &kwargs, &block);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  return mrb_pq_exec_prepared(mrb, self, conn, stmtName, NULL, paramValues_val, nParams, block, mrb_pq_query_deadline(mrb, self, kw_values));
+}
+
+static mrb_value
+mrb_pq_exec_prepared_typed(mrb_state *mrb, mrb_value self)
+{
+  const char *stmtName;
+  mrb_value *declaredTypes_val;
+  mrb_int nDeclaredTypes;
+  mrb_value *paramValues_val = NULL;
+  mrb_int nParams = 0;
+  mrb_value block = mrb_nil_value();
+  MRB_PQ_DEADLINE_KWARGS(kwargs, kw_values);
+  mrb_get_args(mrb, "za|*:&", &stmtName, &declaredTypes_val, &nDeclaredTypes, &paramValues_val, &nParams, &kwargs, &block);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+  double deadline = mrb_pq_query_deadline(mrb, self, kw_values);
+
+  if (nParams && nDeclaredTypes == nParams) {
+    Oid declaredTypes[nParams];
+    for (mrb_int i = 0; i < nParams; i++) {
+      declaredTypes[i] = mrb_integer_p(declaredTypes_val[i]) ? (Oid) mrb_integer(declaredTypes_val[i]) : 0;
+    }
+    return mrb_pq_exec_prepared(mrb, self, conn, stmtName, declaredTypes, paramValues_val, nParams, block, deadline);
+  } else {
+    // the server rejects a wrong number of arguments with a proper error result
+    return mrb_pq_exec_prepared(mrb, self, conn, stmtName, NULL, paramValues_val, nParams, block, deadline);
+  }
+}
+
+static mrb_value
+mrb_PQdescribePrepared(mrb_state *mrb, mrb_value self)
+{
+  const char *stmtName = NULL;
+  mrb_get_args(mrb, "|z!", &stmtName);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  PGresult *res = PQdescribePrepared(conn, stmtName);
+  if (likely(res)) {
+    return mrb_pq_result_processor(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result"), self, res);
+  } else {
+    mrb_sys_fail(mrb, PQresultErrorMessage(res));
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQdescribePortal(mrb_state *mrb, mrb_value self)
+{
+  const char *portalName = NULL;
+  mrb_get_args(mrb, "|z!", &portalName);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  PGresult *res = PQdescribePortal(conn, portalName);
+  if (likely(res)) {
+    return mrb_pq_result_processor(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result"), self, res);
+  } else {
+    mrb_sys_fail(mrb, PQresultErrorMessage(res));
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQsendQuery(mrb_state *mrb, mrb_value self)
+{
+  const char *command;
+  mrb_value *paramValues_val = NULL;
+  mrb_int nParams = 0;
+  mrb_get_args(mrb, "z*", &command, &paramValues_val, &nParams);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  if (unlikely(!mrb_pq_send_query_params(mrb, conn, mrb_pq_types(mrb, self), command, paramValues_val, nParams, mrb_pq_result_format(mrb, self)))) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQsendQueryPrepared(mrb_state *mrb, mrb_value self)
+{
+  const char *stmtName;
+  mrb_value *paramValues_val = NULL;
+  mrb_int nParams = 0;
+  mrb_get_args(mrb, "z*", &stmtName, &paramValues_val, &nParams);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  if (unlikely(!mrb_pq_send_query_prepared(mrb, conn, mrb_pq_types(mrb, self), stmtName, paramValues_val, nParams, mrb_pq_result_format(mrb, self)))) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQsendPrepare(mrb_state *mrb, mrb_value self)
+{
+  const char *stmtName, *query;
+  mrb_get_args(mrb, "zz", &stmtName, &query);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  if (unlikely(!PQsendPrepare(conn, stmtName, query, 0, NULL))) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQgetResult(mrb_state *mrb, mrb_value self)
+{
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  PGresult *res = PQgetResult(conn);
+  if (res) {
+    return mrb_pq_result_processor(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result"), self, res);
+  } else {
+    return mrb_nil_value();
+  }
+}
+
+static mrb_value
+mrb_PQconsumeInput(mrb_state *mrb, mrb_value self)
+{
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  if (unlikely(!PQconsumeInput(conn))) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQisBusy(mrb_state *mrb, mrb_value self)
+{
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  return mrb_bool_value(PQisBusy(conn));
+}
+
+static mrb_value
+mrb_PQflush(mrb_state *mrb, mrb_value self)
+{
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  int ret = PQflush(conn);
+  if (unlikely(ret == -1)) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return mrb_bool_value(ret == 0);
+}
+
+static mrb_value
+mrb_PQsetnonblocking(mrb_state *mrb, mrb_value self)
+{
+  mrb_bool nonblocking;
+  mrb_get_args(mrb, "b", &nonblocking);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  if (unlikely(PQsetnonblocking(conn, nonblocking) == -1)) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return mrb_bool_value(nonblocking);
+}
+
+static mrb_value
+mrb_PQisnonblocking(mrb_state *mrb, mrb_value self)
+{
+  const PGconn *conn = (const PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  return mrb_bool_value(PQisnonblocking(conn));
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+static mrb_value
+mrb_PQenterPipelineMode(mrb_state *mrb, mrb_value self)
+{
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  if (unlikely(!PQenterPipelineMode(conn))) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQexitPipelineMode(mrb_state *mrb, mrb_value self)
+{
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  if (unlikely(!PQexitPipelineMode(conn))) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQpipelineSync(mrb_state *mrb, mrb_value self)
+{
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  if (unlikely(!PQpipelineSync(conn))) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQsendFlushRequest(mrb_state *mrb, mrb_value self)
+{
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  if (unlikely(!PQsendFlushRequest(conn))) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_PQpipelineStatus(mrb_state *mrb, mrb_value self)
+{
+  const PGconn *conn = (const PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  return mrb_int_value(mrb, PQpipelineStatus(conn));
+}
+#endif
+
+static mrb_value
+mrb_PQputCopyData(mrb_state *mrb, mrb_value self)
+{
+  const char *buffer;
+  mrb_int nbytes;
+  mrb_get_args(mrb, "s", &buffer, &nbytes);
+  mrb_assert_int_fit(mrb_int, nbytes, int, INT_MAX);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  int ret = PQputCopyData(conn, buffer, (int) nbytes);
+  if (unlikely(ret == -1)) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return mrb_bool_value(ret == 1);
+}
+
+static mrb_value
+mrb_PQputCopyEnd(mrb_state *mrb, mrb_value self)
+{
+  const char *errormsg = NULL;
+  mrb_get_args(mrb, "|z!", &errormsg);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  int ret = PQputCopyEnd(conn, errormsg);
+  if (unlikely(ret == -1)) {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return mrb_bool_value(ret == 1);
+}
+
+static mrb_value
+mrb_PQgetCopyData(mrb_state *mrb, mrb_value self)
+{
+  mrb_bool async = FALSE;
+  mrb_get_args(mrb, "|b", &async);
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  errno = 0;
+  char *buffer = NULL;
+  int nbytes = PQgetCopyData(conn, &buffer, async);
+  if (nbytes > 0) {
+    struct mrb_jmpbuf* prev_jmp = mrb->jmp;
+    struct mrb_jmpbuf c_jmp;
+    mrb_value data = mrb_nil_value();
+    MRB_TRY(&c_jmp)
+    {
+      mrb->jmp = &c_jmp;
+      data = mrb_str_new(mrb, buffer, nbytes);
+      mrb->jmp = prev_jmp;
+    }
+    MRB_CATCH(&c_jmp)
+    {
+      mrb->jmp = prev_jmp;
+      PQfreemem(buffer);
+      MRB_THROW(mrb->jmp);
+    }
+    MRB_END_EXC(&c_jmp);
+    PQfreemem(buffer);
+    return data;
+  } else if (nbytes == 0) {
+    return mrb_false_value();
+  } else if (nbytes == -1) {
+    return mrb_nil_value();
+  } else {
+    mrb_pq_handle_connection_error(mrb, self, conn);
+  }
+
+  return mrb_nil_value();
+}
+
+// binary COPY data isn't cast by the server, so text is only fine for the types whose binary format is their text
+static inline mrb_bool
+mrb_pq_binary_is_text(Oid type)
+{
+  switch (type) {
+    case 19: // name
+    case 25: // text
+    case 114: // json
+    case 142: // xml
+    case 1042: // bpchar
+    case 1043: // varchar
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+// types is nil or an Array of the oids of the columns, values are then encoded to them instead of to their natural types
+static mrb_value
+mrb_pq_copy_encode_row(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *values;
+  mrb_int nvalues;
+  mrb_value types = mrb_nil_value();
+  mrb_get_args(mrb, "a|A!", &values, &nvalues, &types);
+  if (unlikely(nvalues > INT16_MAX)) {
+    mrb_raise(mrb, E_RANGE_ERROR, "too many columns for a COPY tuple");
+  }
+  if (!mrb_nil_p(types) && RARRAY_LEN(types) != nvalues) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%i values for %i column types", nvalues, RARRAY_LEN(types));
+  }
+
+  mrb_value tuple = mrb_str_buf_new(mrb, 2 + nvalues * 12);
+  char header[4];
+  mrb_pq_write_uint16(header, (uint16_t) nvalues);
+  mrb_str_cat(mrb, tuple, header, 2);
+
+  char scratch[MRB_PQ_SCRATCH_SIZE];
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (mrb_int i = 0; i < nvalues; i++) {
+    Oid declaredType = mrb_nil_p(types) ? 0 : (Oid) mrb_as_int(mrb, RARRAY_PTR(types)[i]);
+    Oid paramType;
+    int paramLength, paramFormat;
+    const char *paramValue = mrb_pq_encode_value(mrb, mrb_nil_value(), values[i], declaredType, scratch, &paramType, &paramLength, &paramFormat);
+    if (paramValue && declaredType) {
+      // Strings are copied as they are, their paramType is 0
+      mrb_bool matches = paramType == 16 ? declaredType == 16 :
+        (paramFormat == 1 || mrb_pq_binary_is_text(declaredType)) && (paramType == 0 || paramType == declaredType);
+      if (!matches) {
+        mrb_raisef(mrb, E_TYPE_ERROR, "cannot COPY %T into a column of type %d in the binary format", values[i], (int) declaredType);
+      }
+    }
+    if (!paramValue) {
+      mrb_pq_write_uint32(header, (uint32_t) -1);
+      mrb_str_cat(mrb, tuple, header, 4);
+    } else if (paramType == 16) { // bool is sent as text for query parameters
+      mrb_pq_write_uint32(header, 1);
+      mrb_str_cat(mrb, tuple, header, 4);
+      mrb_str_cat(mrb, tuple, paramValue[0] == 't' ? "\1" : "\0", 1);
+    } else {
+      mrb_pq_write_uint32(header, (uint32_t) paramLength);
+      mrb_str_cat(mrb, tuple, header, 4);
+      mrb_str_cat(mrb, tuple, paramValue, paramLength);
+    }
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+
+  return tuple;
+}
+
+static mrb_value
+mrb_PQbinaryTuples(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(PQbinaryTuples((const PGresult *) DATA_PTR(self)));
+}
+
+static void
+mrb_PQnoticeReceiver(void *arg_, const PGresult *res)
+{
+  mrb_PQnoticeReceiver_arg *arg = (mrb_PQnoticeReceiver_arg *) arg_;
+  int arena_index = mrb_gc_arena_save(arg->mrb);
+  mrb_yield(arg->mrb, arg->block, mrb_pq_result_processor(arg->mrb, arg->pq_result_class, mrb_nil_value(), res));
+  mrb_gc_arena_restore(arg->mrb, arena_index);
+}
+
+static mrb_value
+mrb_PQsetNoticeReceiver(mrb_state *mrb, mrb_value self)
+{
+  mrb_value block = mrb_nil_value();
+  mrb_get_args(mrb, "&", &block);
+  if (mrb_nil_p(block)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+  if (mrb_type(block) != MRB_TT_PROC) {
+    mrb_raise(mrb, E_TYPE_ERROR, "not a block");
+  }
+  PGconn *conn = (PGconn *) DATA_PTR(self);
+  if (!conn) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  }
+
+  struct RClass *pq_class = mrb_obj_class(mrb, self);
+  struct RClass *pq_result_class = mrb_class_get_under(mrb, pq_class, "Result");
+  mrb_PQnoticeReceiver_arg *arg;
+  struct RData *notice_receiver_data;
+  Data_Make_Struct(mrb, mrb_class_get_under(mrb, pq_class, "NoticeReceiver"), mrb_PQnoticeReceiver_arg, &mrb_PQnoticeReceiver_type, arg, notice_receiver_data);
+  arg->mrb = mrb;
+  arg->pq_result_class = pq_result_class;
+  arg->block = block;
+  mrb_value notice_receiver = mrb_obj_value(notice_receiver_data);
+  mrb_iv_set(mrb, notice_receiver, mrb_intern_lit(mrb, "block"), block);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "notice_receiver"), notice_receiver);
+
+  PQsetNoticeReceiver(conn, mrb_PQnoticeReceiver, arg);
+
+  return self;
+}
+
+static mrb_value
+mrb_PQntuples(mrb_state *mrb, mrb_value self)
+{
+  return mrb_int_value(mrb, PQntuples((const PGresult *) DATA_PTR(self)));
+}
+
+static mrb_value
+mrb_PQnfields(mrb_state *mrb, mrb_value self)
+{
+  return mrb_int_value(mrb, PQnfields((const PGresult *) DATA_PTR(self)));
+}
+
+static mrb_value
+mrb_PQfname(mrb_state *mrb, mrb_value self)
+{
+  mrb_int column_number;
+  mrb_get_args(mrb, "i", &column_number);
+  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
+
+  char *fname = PQfname((const PGresult *) DATA_PTR(self), (int) column_number);
+  if (fname) {
+    return mrb_str_new_cstr(mrb, fname);
+  } else {
+    return mrb_nil_value();
+  }
+}
+
+static mrb_value
+mrb_PQfnumber(mrb_state *mrb, mrb_value self)
+{
+  const char *column_name;
+  mrb_get_args(mrb, "z", &column_name);
+
+  int fnumber = PQfnumber((const PGresult *) DATA_PTR(self), column_name);
+  if (fnumber != -1) {
+    return mrb_int_value(mrb, fnumber);
+  } else {
+    return mrb_nil_value();
+  }
+}
+
+static mrb_value
+mrb_PQftable(mrb_state *mrb, mrb_value self)
+{
+  mrb_int column_number;
+  mrb_get_args(mrb, "i", &column_number);
+  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
+
+  Oid foo = PQftable((const PGresult *) DATA_PTR(self), (int) column_number);
+  if (foo == InvalidOid) {
+    mrb_raise(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "InvalidOid"), "Column number is out of range, or the specified column is not a simple reference to a table column, or using pre-3.0 protocol");
+  }
+
+  return mrb_int_value(mrb, foo);
+}
+
+static mrb_value
+mrb_PQftablecol(mrb_state *mrb, mrb_value self)
+{
+  mrb_int column_number;
+  mrb_get_args(mrb, "i", &column_number);
+  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
+
+  int foo = PQftablecol((const PGresult *) DATA_PTR(self), (int) column_number);
+  if (foo == 0) {
+    mrb_raise(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Error"), "Column number is out of range, or the specified column is not a simple reference to a table column, or using pre-3.0 protocol");
+  }
+
+  return mrb_int_value(mrb, foo);
+}
+
+static mrb_value
+mrb_PQfformat(mrb_state *mrb, mrb_value self)
+{
+  mrb_int column_number;
+  mrb_get_args(mrb, "i", &column_number);
+  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
+
+  return mrb_int_value(mrb, PQfformat((const PGresult *) DATA_PTR(self), (int) column_number));
+}
+
+static mrb_value
+mrb_PQftype(mrb_state *mrb, mrb_value self)
+{
+  mrb_int column_number;
+  mrb_get_args(mrb, "i", &column_number);
+  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
+
+  return mrb_int_value(mrb, PQftype((const PGresult *) DATA_PTR(self), (int) column_number));
+}
+
+static mrb_value
+mrb_pq_decode_string(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_str_new(mrb, value, length);
+}
+
+// value of a hex digit, -1 for everything else
+static const int8_t mrb_pq_hex_values[256] = {
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+#if defined(__AVX2__)
+// turns 64 hex digits into 32 bytes, returns FALSE if one of them isn't a hex digit
+static inline mrb_bool
+mrb_pq_hex_decode_block(const char *src, char *dst)
+{
+  __m256i digits[2];
+  for (int i = 0; i < 2; i++) {
+    __m256i chars = _mm256_loadu_si256((const __m256i *) (src + i * 32));
+    __m256i lower = _mm256_or_si256(chars, _mm256_set1_epi8(0x20));
+    __m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(chars, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), chars));
+    __m256i is_alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+    if (unlikely(_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)) != -1)) {
+      return FALSE;
+    }
+    __m256i nibbles = _mm256_or_si256(_mm256_and_si256(is_digit, _mm256_sub_epi8(chars, _mm256_set1_epi8('0'))),
+      _mm256_and_si256(is_alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+    // the first digit of each pair is in the low byte of a 16 bit lane
+    digits[i] = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(nibbles, _mm256_set1_epi16(0x00FF)), 4), _mm256_srli_epi16(nibbles, 8));
+  }
+  // packus works per 128 bit lane, the permute puts the quadwords back in order
+  __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(digits[0], digits[1]), 0xD8);
+  _mm256_storeu_si256((__m256i *) dst, bytes);
+  return TRUE;
+}
+#define MRB_PQ_HEX_BLOCK 64
+#elif defined(__SSE2__)
+// turns 32 hex digits into 16 bytes, returns FALSE if one of them isn't a hex digit
+static inline mrb_bool
+mrb_pq_hex_decode_block(const char *src, char *dst)
+{
+  __m128i digits[2];
+  for (int i = 0; i < 2; i++) {
+    __m128i chars = _mm_loadu_si128((const __m128i *) (src + i * 16));
+    __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(chars, _mm_set1_epi8('9' + 1)));
+    __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    if (unlikely(_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xFFFF)) {
+      return FALSE;
+    }
+    __m128i nibbles = _mm_or_si128(_mm_and_si128(is_digit, _mm_sub_epi8(chars, _mm_set1_epi8('0'))),
+      _mm_and_si128(is_alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+    // the first digit of each pair is in the low byte of a 16 bit lane
+    digits[i] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00FF)), 4), _mm_srli_epi16(nibbles, 8));
+  }
+  _mm_storeu_si128((__m128i *) dst, _mm_packus_epi16(digits[0], digits[1]));
+  return TRUE;
+}
+#define MRB_PQ_HEX_BLOCK 32
+#endif
+
+// decodes length hex digits into length / 2 bytes, returns FALSE on anything which isn't a hex digit
+static mrb_bool
+mrb_pq_hex_decode(const char *src, mrb_int length, char *dst)
+{
+  mrb_int i = 0;
+#ifdef MRB_PQ_HEX_BLOCK
+  for (; i + MRB_PQ_HEX_BLOCK <= length; i += MRB_PQ_HEX_BLOCK) {
+    if (unlikely(!mrb_pq_hex_decode_block(src + i, dst + i / 2))) {
+      return FALSE;
+    }
+  }
+#endif
+  for (; i + 1 < length; i += 2) {
+    int high = mrb_pq_hex_values[(uint8_t) src[i]];
+    int low = mrb_pq_hex_values[(uint8_t) src[i + 1]];
+    if (unlikely((high | low) < 0)) {
+      return FALSE;
+    }
+    dst[i / 2] = (char) ((high << 4) | low);
+  }
+
+  return TRUE;
+}
+
+// the legacy escape format, printable bytes as they are, a backslash as \\ and everything else as \ooo
+static mrb_value
+mrb_pq_decode_bytea_escape(mrb_state *mrb, const char *value, int length)
+{
+  mrb_value bytes = mrb_str_new(mrb, NULL, length);
+  char *dst = RSTRING_PTR(bytes);
+  mrb_int size = 0;
+  for (int i = 0; i < length;) {
+    if (value[i] != '\\') {
+      dst[size++] = value[i++];
+    } else if (i + 1 < length && value[i + 1] == '\\') {
+      dst[size++] = '\\';
+      i += 2;
+    } else if (i + 3 < length && value[i + 1] >= '0' && value[i + 1] <= '3' &&
+      value[i + 2] >= '0' && value[i + 2] <= '7' && value[i + 3] >= '0' && value[i + 3] <= '7') {
+      dst[size++] = (char) (((value[i + 1] - '0') << 6) | ((value[i + 2] - '0') << 3) | (value[i + 3] - '0'));
+      i += 4;
+    } else {
+      dst[size++] = value[i++];
+    }
+  }
+
+  return mrb_str_resize(mrb, bytes, size);
+}
+
+static mrb_value
+mrb_pq_decode_text_bytea(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (length >= 2 && value[0] == '\\' && value[1] == 'x') {
+    if (unlikely(length % 2)) {
+      return mrb_pq_decode_string(mrb, value, length, decoder);
+    }
+    // decoded straight into the string which is returned
+    mrb_value bytes = mrb_str_new(mrb, NULL, (length - 2) / 2);
+    if (unlikely(!mrb_pq_hex_decode(value + 2, length - 2, RSTRING_PTR(bytes)))) {
+      return mrb_pq_decode_string(mrb, value, length, decoder);
+    }
+    return bytes;
+  }
+
+  return mrb_pq_decode_bytea_escape(mrb, value, length);
+}
+
+static mrb_value
+mrb_pq_decode_text_bool(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_bool_value(value[0] == 't');
+}
+
+static mrb_value
+mrb_pq_decode_text_int64(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_int_value(mrb, strtoll(value, NULL, 0));
+}
+
+static mrb_value
+mrb_pq_decode_text_int32(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_int_value(mrb, strtol(value, NULL, 0));
+}
+
+static mrb_value
+mrb_pq_decode_text_json(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (mrb_class_defined(mrb, "JSON")) {
+    return mrb_funcall(mrb, mrb_obj_value(mrb_module_get(mrb, "JSON")), "parse", 1, mrb_str_new(mrb, value, length));
+  } else {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+}
+
+static mrb_value
+mrb_pq_decode_text_xml(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (mrb_class_defined(mrb, "XML")) {
+    return mrb_funcall(mrb, mrb_obj_value(mrb_module_get(mrb, "XML")), "parse", 1, mrb_str_new(mrb, value, length));
+  } else {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+}
+
+#ifndef MRB_WITHOUT_FLOAT
+static mrb_value
+mrb_pq_decode_text_float(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_float_value(mrb, strtof(value, NULL));
+}
+
+#ifndef MRB_USE_FLOAT
+static mrb_value
+mrb_pq_decode_text_double(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_float_value(mrb, strtod(value, NULL));
+}
+#endif
+#endif
+
+static mrb_value
+mrb_pq_time_value(mrb_state *mrb, int64_t unix_usec, mrb_bool utc, const mrb_pq_decoder *decoder)
+{
+  if (decoder && decoder->epoch_usec) {
+    return mrb_int_value(mrb, (mrb_int) unix_usec);
+  }
+  return mrb_pq_time_from_usec(mrb, unix_usec, utc);
+}
+
+// days since 1970-01-01 in the proleptic gregorian calendar, which is what postgres uses
+static int64_t
+mrb_pq_days_from_civil(int64_t year, int64_t month, int64_t day)
+{
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t year_of_era = year - era * 400;
+  int64_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+static const char *
+mrb_pq_parse_digits(const char *p, const char *end, int min_digits, int max_digits, int64_t *number)
+{
+  int64_t n = 0;
+  int digits = 0;
+  while (p < end && digits < max_digits && *p >= '0' && *p <= '9') {
+    n = n * 10 + (*p++ - '0');
+    digits++;
+  }
+  if (digits < min_digits) {
+    return NULL;
+  }
+  *number = n;
+  return p;
+}
+
+// YYYY-MM-DD of the ISO DateStyle, yields days since 1970-01-01, years before 1 AD are handled by the caller
+static const char *
+mrb_pq_parse_date(const char *p, const char *end, int64_t *days)
+{
+  int64_t year, month, day;
+  if (!(p = mrb_pq_parse_digits(p, end, 4, 9, &year)) || p >= end || *p++ != '-' ||
+    !(p = mrb_pq_parse_digits(p, end, 2, 2, &month)) || p >= end || *p++ != '-' ||
+    !(p = mrb_pq_parse_digits(p, end, 2, 2, &day)) || month < 1 || month > 12 || day < 1 || day > 31) {
+    return NULL;
+  }
+  if (end - p >= 3 && memcmp(end - 3, " BC", 3) == 0) {
+    year = 1 - year;
+  }
+  *days = mrb_pq_days_from_civil(year, month, day);
+  return p;
+}
+
+// HH:MM:SS[.ffffff], yields microseconds, intervals can have more than two digits of hours
+static const char *
+mrb_pq_parse_clock(const char *p, const char *end, int max_hour_digits, int64_t *usec)
+{
+  int64_t hours, minutes, seconds, fraction = 0;
+  if (!(p = mrb_pq_parse_digits(p, end, 1, max_hour_digits, &hours)) || p >= end || *p++ != ':' ||
+    !(p = mrb_pq_parse_digits(p, end, 2, 2, &minutes)) || p >= end || *p++ != ':' ||
+    !(p = mrb_pq_parse_digits(p, end, 2, 2, &seconds))) {
+    return NULL;
+  }
+  if (p < end && *p == '.') {
+    const char *digits = ++p;
+    if (!(p = mrb_pq_parse_digits(p, end, 1, 6, &fraction))) {
+      return NULL;
+    }
+    for (ptrdiff_t i = p - digits; i < 6; i++) {
+      fraction *= 10;
+    }
+  }
+  *usec = ((hours * 60 + minutes) * 60 + seconds) * 1000000 + fraction;
+  return p;
+}
+
+static mrb_value
+mrb_pq_decode_text_date(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  const char *end = value + length;
+  int64_t days;
+  const char *p = mrb_pq_parse_date(value, end, &days);
+  if (unlikely(!p || (p != end && !(end - p == 3 && memcmp(p, " BC", 3) == 0)))) {
+    // infinity or another DateStyle
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+
+  return mrb_pq_time_value(mrb, days * 86400 * 1000000, TRUE, decoder);
+}
+
+static mrb_value
+mrb_pq_decode_text_timestamp_with_zone(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder, mrb_bool with_zone)
+{
+  const char *end = value + length;
+  int64_t days, usec, offset = 0;
+  const char *p = mrb_pq_parse_date(value, end, &days);
+  if (unlikely(!p || p >= end || *p++ != ' ' || !(p = mrb_pq_parse_clock(p, end, 2, &usec)))) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  if (with_zone) {
+    // the session TimeZone is always printed as a numeric offset: +HH[:MM[:SS]]
+    int64_t hours, minutes = 0, seconds = 0;
+    if (unlikely(p >= end || (*p != '+' && *p != '-'))) {
+      return mrb_pq_decode_string(mrb, value, length, decoder);
+    }
+    mrb_bool negative = *p++ == '-';
+    if (unlikely(!(p = mrb_pq_parse_digits(p, end, 2, 2, &hours)) ||
+      (p < end && *p == ':' && !(p = mrb_pq_parse_digits(p + 1, end, 2, 2, &minutes))) ||
+      (p < end && *p == ':' && !(p = mrb_pq_parse_digits(p + 1, end, 2, 2, &seconds))))) {
+      return mrb_pq_decode_string(mrb, value, length, decoder);
+    }
+    offset = (hours * 3600 + minutes * 60 + seconds) * 1000000;
+    if (negative) {
+      offset = -offset;
+    }
+  }
+  if (unlikely(p != end && !(end - p == 3 && memcmp(p, " BC", 3) == 0))) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+
+  return mrb_pq_time_value(mrb, days * 86400 * 1000000 + usec - offset, !with_zone, decoder);
+}
+
+static mrb_value
+mrb_pq_decode_text_timestamp(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_pq_decode_text_timestamp_with_zone(mrb, value, length, decoder, FALSE);
+}
+
+static mrb_value
+mrb_pq_decode_text_timestamptz(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_pq_decode_text_timestamp_with_zone(mrb, value, length, decoder, TRUE);
+}
+
+// a time of day has no date to make a Time of, it becomes microseconds since midnight
+static mrb_value
+mrb_pq_decode_text_time(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  const char *end = value + length;
+  int64_t usec;
+  const char *p = mrb_pq_parse_clock(value, end, 2, &usec);
+  if (unlikely(!p || p != end)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+
+  return mrb_int_value(mrb, (mrb_int) usec);
+}
+
+// months and days can't be converted to a fixed number of microseconds, so intervals are [months, days, microseconds] like on the wire
+static mrb_value
+mrb_pq_interval_new(mrb_state *mrb, int64_t months, int64_t days, int64_t usec)
+{
+  mrb_value interval[3] = { mrb_int_value(mrb, (mrb_int) months), mrb_int_value(mrb, (mrb_int) days), mrb_int_value(mrb, (mrb_int) usec) };
+  return mrb_ary_new_from_values(mrb, 3, interval);
+}
+
+// the default "postgres" IntervalStyle: 1 year 2 mons -3 days +04:05:06.789
+static mrb_value
+mrb_pq_decode_text_interval(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  const char *p = value, *end = value + length;
+  int64_t months = 0, days = 0, usec = 0;
+  while (p < end) {
+    mrb_bool negative = *p == '-';
+    if (*p == '-' || *p == '+') {
+      p++;
+    }
+    const char *digits_end = p;
+    while (digits_end < end && *digits_end >= '0' && *digits_end <= '9') {
+      digits_end++;
+    }
+    int64_t n;
+    if (digits_end < end && *digits_end == ':') {
+      if (unlikely(!(p = mrb_pq_parse_clock(p, end, 18, &n)))) {
+        return mrb_pq_decode_string(mrb, value, length, decoder);
+      }
+      usec += negative ? -n : n;
+    } else {
+      if (unlikely(!(p = mrb_pq_parse_digits(p, end, 1, 18, &n)) || p >= end || *p++ != ' ')) {
+        return mrb_pq_decode_string(mrb, value, length, decoder);
+      }
+      if (negative) {
+        n = -n;
+      }
+      const char *unit = p;
+      while (p < end && *p != ' ') {
+        p++;
+      }
+      size_t unit_length = p - unit;
+      if (unit_length >= 3 && unit_length <= 4 && memcmp(unit, "mons", unit_length) == 0) {
+        months += n;
+      } else if (unit_length >= 4 && unit_length <= 5 && memcmp(unit, "years", unit_length) == 0) {
+        months += n * 12;
+      } else if (unit_length >= 3 && unit_length <= 4 && memcmp(unit, "days", unit_length) == 0) {
+        days += n;
+      } else {
+        return mrb_pq_decode_string(mrb, value, length, decoder);
+      }
+    }
+    if (p < end && *p++ != ' ') {
+      return mrb_pq_decode_string(mrb, value, length, decoder);
+    }
+  }
+
+  return mrb_pq_interval_new(mrb, months, days, usec);
+}
+
+// parses one level of the text array format, *cursor points at its opening brace
+static mrb_value
+mrb_pq_parse_text_array(mrb_state *mrb, const char **cursor, const char *end, const mrb_pq_decoder *decoder, char *buf, mrb_value null_value)
+{
+  const char *p = *cursor + 1;
+  mrb_value array = mrb_ary_new(mrb);
+  int arena_index = mrb_gc_arena_save(mrb);
+
+  while (p < end && *p != '}') {
+    if (*p == '{') {
+      mrb_ary_push(mrb, array, mrb_pq_parse_text_array(mrb, &p, end, decoder, buf, null_value));
+    } else {
+      int length = 0;
+      mrb_bool quoted = (*p == '"');
+      if (quoted) {
+        p++;
+        while (p < end && *p != '"') {
+          if (*p == '\\' && p + 1 < end) {
+            p++;
+          }
+          buf[length++] = *p++;
+        }
+        p++;
+      } else {
+        while (p < end && *p != ',' && *p != '}') {
+          if (*p == '\\' && p + 1 < end) {
+            p++;
+          }
+          buf[length++] = *p++;
+        }
+      }
+      buf[length] = '\0';
+      if (!quoted && length == 4 && strncasecmp(buf, "NULL", 4) == 0) {
+        mrb_ary_push(mrb, array, null_value);
+      } else {
+        mrb_ary_push(mrb, array, decoder->element(mrb, buf, length, decoder));
+      }
+    }
+    mrb_gc_arena_restore(mrb, arena_index);
+    if (p < end && *p == ',') {
+      p++;
+    }
+  }
+  *cursor = p + 1;
+
+  return array;
+}
+
+static mrb_value
+mrb_pq_decode_text_array(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  const char *p = value;
+  const char *end = value + length;
+  if (*p == '[') {
+    // explicit bounds like [0:2]={1,2,3}
+    p = memchr(value, '=', length);
+    if (unlikely(!p)) {
+      return mrb_pq_decode_string(mrb, value, length, decoder);
+    }
+    p++;
+  }
+  if (unlikely(p >= end || *p != '{' || !decoder || !decoder->element)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  // no element is longer than the whole array
+  mrb_value buf = mrb_str_new(mrb, NULL, length);
+
+  return mrb_pq_parse_text_array(mrb, &p, end, decoder, RSTRING_PTR(buf), mrb_symbol_value(mrb_intern_lit(mrb, "NULL")));
+}
+
+// text records carry no type information, their fields are returned as strings
+static mrb_value
+mrb_pq_decode_text_record(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  const char *p = value;
+  const char *end = value + length;
+  if (unlikely(length < 2 || *p != '(')) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  p++;
+  end--; // closing parenthesis
+  mrb_value null_value = mrb_symbol_value(mrb_intern_lit(mrb, "NULL"));
+  mrb_value fields = mrb_ary_new(mrb);
+  mrb_value buf = mrb_str_new(mrb, NULL, length);
+  char *dst = RSTRING_PTR(buf);
+  int arena_index = mrb_gc_arena_save(mrb);
+
+  for (;;) {
+    int field_length = 0;
+    mrb_bool quoted = FALSE;
+    while (p < end && *p != ',') {
+      if (*p == '"') {
+        quoted = TRUE;
+        p++;
+        while (p < end) {
+          if (*p == '"') {
+            if (p + 1 < end && p[1] == '"') {
+              p++;
+            } else {
+              break;
+            }
+          } else if (*p == '\\' && p + 1 < end) {
+            p++;
+          }
+          dst[field_length++] = *p++;
+        }
+        p++;
+      } else {
+        if (*p == '\\' && p + 1 < end) {
+          p++;
+        }
+        dst[field_length++] = *p++;
+      }
+    }
+    if (field_length == 0 && !quoted) {
+      mrb_ary_push(mrb, fields, null_value);
+    } else {
+      mrb_ary_push(mrb, fields, mrb_str_new(mrb, dst, field_length));
+    }
+    mrb_gc_arena_restore(mrb, arena_index);
+    if (p >= end) {
+      break;
+    }
+    p++;
+  }
+
+  return fields;
+}
+
+static mrb_value
+mrb_pq_parse_binary_array(mrb_state *mrb, const char **cursor, const char *end, const int32_t *dims, int ndim, mrb_pq_decode_func element, const mrb_pq_decoder *decoder, mrb_value null_value)
+{
+  // every element takes at least four bytes, don't trust the dimensions for preallocation
+  mrb_value array = mrb_ary_new_capa(mrb, dims[0] <= (end - *cursor) / 4 ? dims[0] : 0);
+  int arena_index = mrb_gc_arena_save(mrb);
+
+  for (int32_t i = 0; i < dims[0]; i++) {
+    if (ndim > 1) {
+      mrb_ary_push(mrb, array, mrb_pq_parse_binary_array(mrb, cursor, end, dims + 1, ndim - 1, element, decoder, null_value));
+    } else {
+      if (unlikely(end - *cursor < 4)) {
+        mrb_raise(mrb, E_RANGE_ERROR, "truncated binary array");
+      }
+      int32_t length = (int32_t) mrb_pq_read_uint32(*cursor);
+      *cursor += 4;
+      if (length == -1) {
+        mrb_ary_push(mrb, array, null_value);
+      } else {
+        if (unlikely(length < 0 || end - *cursor < length)) {
+          mrb_raise(mrb, E_RANGE_ERROR, "truncated binary array");
+        }
+        mrb_ary_push(mrb, array, element(mrb, *cursor, length, decoder));
+        *cursor += length;
+      }
+    }
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+
+  return array;
+}
+
+static mrb_pq_decode_func mrb_pq_binary_decoder(Oid type);
+
+static mrb_value
+mrb_pq_decode_binary_array(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length < 12)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  int32_t ndim = (int32_t) mrb_pq_read_uint32(value);
+  Oid element_type = mrb_pq_read_uint32(value + 8);
+  if (ndim == 0) {
+    return mrb_ary_new(mrb);
+  }
+  if (unlikely(ndim < 0 || ndim > 6 || length < 12 + ndim * 8)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  int32_t dims[6];
+  for (int32_t i = 0; i < ndim; i++) {
+    dims[i] = (int32_t) mrb_pq_read_uint32(value + 12 + i * 8);
+    if (unlikely(dims[i] < 0)) {
+      return mrb_pq_decode_string(mrb, value, length, decoder);
+    }
+  }
+  const char *p = value + 12 + ndim * 8;
+  mrb_pq_decode_func element = decoder && decoder->element ? decoder->element : mrb_pq_binary_decoder(element_type);
+
+  return mrb_pq_parse_binary_array(mrb, &p, value + length, dims, ndim, element, decoder, mrb_symbol_value(mrb_intern_lit(mrb, "NULL")));
+}
+
+static mrb_value
+mrb_pq_decode_binary_record(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length < 4)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  int32_t nfields = (int32_t) mrb_pq_read_uint32(value);
+  const char *p = value + 4;
+  const char *end = value + length;
+  mrb_value null_value = mrb_symbol_value(mrb_intern_lit(mrb, "NULL"));
+  mrb_value fields = mrb_ary_new_capa(mrb, nfields > 0 ? nfields : 0);
+  int arena_index = mrb_gc_arena_save(mrb);
+
+  for (int32_t i = 0; i < nfields; i++) {
+    if (unlikely(end - p < 8)) {
+      mrb_raise(mrb, E_RANGE_ERROR, "truncated binary record");
+    }
+    Oid type = mrb_pq_read_uint32(p);
+    int32_t field_length = (int32_t) mrb_pq_read_uint32(p + 4);
+    p += 8;
+    if (field_length == -1) {
+      mrb_ary_push(mrb, fields, null_value);
+    } else {
+      if (unlikely(field_length < 0 || end - p < field_length)) {
+        mrb_raise(mrb, E_RANGE_ERROR, "truncated binary record");
+      }
+      mrb_ary_push(mrb, fields, mrb_pq_binary_decoder(type)(mrb, p, field_length, NULL));
+      p += field_length;
+    }
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+
+  return fields;
+}
+
+static mrb_pq_decode_func
+mrb_pq_text_decoder(Oid type)
+{
+  switch(type) {
+    case 16: // bool
+      return mrb_pq_decode_text_bool;
+    case 20: // int64_t
+      return mrb_pq_decode_text_int64;
+    case 23: // int32_t
+    case 21: // int16_t
+      return mrb_pq_decode_text_int32;
+    case 114:
+    case 3802:
+      return mrb_pq_decode_text_json;
+    case 142:
+      return mrb_pq_decode_text_xml;
+    case 2249: // record
+      return mrb_pq_decode_text_record;
+    case 17: // bytea
+      return mrb_pq_decode_text_bytea;
+    case 1082: // date
+      return mrb_pq_decode_text_date;
+    case 1114: // timestamp
+      return mrb_pq_decode_text_timestamp;
+    case 1184: // timestamptz
+      return mrb_pq_decode_text_timestamptz;
+    case 1083: // time
+      return mrb_pq_decode_text_time;
+    case 1186: // interval
+      return mrb_pq_decode_text_interval;
+#ifndef MRB_WITHOUT_FLOAT
+    case 700: // float
+      return mrb_pq_decode_text_float;
+#ifndef MRB_USE_FLOAT
+    case 701: // double
+      return mrb_pq_decode_text_double;
+#endif
+#endif
+    default:
+      return mrb_pq_decode_string;
+  }
+}
+
+static mrb_value
+mrb_pq_decode_binary_bool(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length != 1)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  return mrb_bool_value(value[0] != 0);
+}
+
+static mrb_value
+mrb_pq_decode_binary_int64(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length != 8)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  return mrb_int_value(mrb, (int64_t) mrb_pq_read_uint64(value));
+}
+
+static mrb_value
+mrb_pq_decode_binary_int32(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length != 4)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  return mrb_int_value(mrb, (int32_t) mrb_pq_read_uint32(value));
+}
+
+static mrb_value
+mrb_pq_decode_binary_int16(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length != 2)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  return mrb_int_value(mrb, (int16_t) mrb_pq_read_uint16(value));
+}
+
+static mrb_value
+mrb_pq_decode_binary_oid(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length != 4)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  return mrb_int_value(mrb, mrb_pq_read_uint32(value));
+}
+
+#ifndef MRB_WITHOUT_FLOAT
+static mrb_value
+mrb_pq_decode_binary_float(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length != 4)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  union {
+    float f;
+    uint32_t i;
+  } swap;
+  swap.i = mrb_pq_read_uint32(value);
+  return mrb_float_value(mrb, swap.f);
+}
+
+static mrb_value
+mrb_pq_decode_binary_double(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length != 8)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  union {
+    double f;
+    uint64_t i;
+  } swap;
+  swap.i = mrb_pq_read_uint64(value);
+  return mrb_float_value(mrb, (mrb_float) swap.f);
+}
+#endif
+
+static mrb_value
+mrb_pq_decode_binary_numeric(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length < 8)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  int ndigits = (int16_t) mrb_pq_read_uint16(value);
+  int weight = (int16_t) mrb_pq_read_uint16(value + 2);
+  uint16_t sign = mrb_pq_read_uint16(value + 4);
+  int dscale = (int16_t) mrb_pq_read_uint16(value + 6);
+  const char *digits = value + 8;
+
+  switch (sign) {
+    case 0xC000:
+      return mrb_str_new_lit(mrb, "NaN");
+    case 0xD000:
+      return mrb_str_new_lit(mrb, "Infinity");
+    case 0xF000:
+      return mrb_str_new_lit(mrb, "-Infinity");
+  }
+  if (unlikely(ndigits < 0 || length < 8 + ndigits * 2)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+
+  mrb_value str = mrb_str_buf_new(mrb, (weight > 0 ? weight * 4 : 0) + dscale + 8);
+  char buf[8];
+  if (sign == 0x4000) {
+    mrb_str_cat_lit(mrb, str, "-");
+  }
+  if (weight < 0) {
+    mrb_str_cat_lit(mrb, str, "0");
+  } else {
+    for (int d = 0; d <= weight; d++) {
+      int digit = d < ndigits ? (int16_t) mrb_pq_read_uint16(digits + d * 2) : 0;
+      mrb_str_cat(mrb, str, buf, snprintf(buf, sizeof(buf), d == 0 ? "%d" : "%04d", digit));
+    }
+  }
+  if (dscale > 0) {
+    mrb_str_cat_lit(mrb, str, ".");
+    for (int d = weight + 1, emitted = 0; emitted < dscale; d++, emitted += 4) {
+      int digit = (d >= 0 && d < ndigits) ? (int16_t) mrb_pq_read_uint16(digits + d * 2) : 0;
+      snprintf(buf, sizeof(buf), "%04d", digit);
+      mrb_str_cat(mrb, str, buf, dscale - emitted < 4 ? dscale - emitted : 4);
+    }
+  }
+
+  return str;
+}
+
+static mrb_value
+mrb_pq_decode_binary_uuid(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length != 16)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  static const char hex[] = "0123456789abcdef";
+  mrb_value str = mrb_str_new(mrb, NULL, 36);
+  char *dst = RSTRING_PTR(str);
+  for (int i = 0; i < 16; i++) {
+    if (i == 4 || i == 6 || i == 8 || i == 10) {
+      *dst++ = '-';
+    }
+    *dst++ = hex[((uint8_t) value[i]) >> 4];
+    *dst++ = hex[((uint8_t) value[i]) & 0x0F];
+  }
+
+  return str;
+}
+
+static mrb_value
+mrb_pq_decode_binary_date(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length != 4)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  int32_t days = (int32_t) mrb_pq_read_uint32(value);
+  if (unlikely(days == INT32_MAX)) {
+    return mrb_str_new_lit(mrb, "infinity");
+  } else if (unlikely(days == INT32_MIN)) {
+    return mrb_str_new_lit(mrb, "-infinity");
+  }
+
+  return mrb_pq_time_value(mrb, ((int64_t) days * 86400 + MRB_PQ_POSTGRES_EPOCH) * 1000000, TRUE, decoder);
+}
+
+static mrb_value
+mrb_pq_decode_binary_usec(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder, mrb_bool utc)
+{
+  if (unlikely(length != 8)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  int64_t usec = (int64_t) mrb_pq_read_uint64(value);
+  if (unlikely(usec == INT64_MAX)) {
+    return mrb_str_new_lit(mrb, "infinity");
+  } else if (unlikely(usec == INT64_MIN)) {
+    return mrb_str_new_lit(mrb, "-infinity");
+  }
+
+  return mrb_pq_time_value(mrb, usec + (int64_t) MRB_PQ_POSTGRES_EPOCH * 1000000, utc, decoder);
+}
+
+static mrb_value
+mrb_pq_decode_binary_timestamp(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_pq_decode_binary_usec(mrb, value, length, decoder, TRUE);
+}
+
+static mrb_value
+mrb_pq_decode_binary_timestamptz(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_pq_decode_binary_usec(mrb, value, length, decoder, FALSE);
+}
+
+static mrb_value
+mrb_pq_decode_binary_time(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length != 8)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  return mrb_int_value(mrb, (mrb_int) (int64_t) mrb_pq_read_uint64(value));
+}
+
+static mrb_value
+mrb_pq_decode_binary_interval(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length != 16)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  return mrb_pq_interval_new(mrb, (int32_t) mrb_pq_read_uint32(value + 12), (int32_t) mrb_pq_read_uint32(value + 8), (int64_t) mrb_pq_read_uint64(value));
+}
+
+static mrb_value
+mrb_pq_decode_binary_jsonb(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  // a version byte followed by the text representation
+  if (unlikely(length < 1 || value[0] != 1)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  if (mrb_class_defined(mrb, "JSON")) {
+    return mrb_funcall(mrb, mrb_obj_value(mrb_module_get(mrb, "JSON")), "parse", 1, mrb_str_new(mrb, value + 1, length - 1));
+  } else {
+    return mrb_str_new(mrb, value + 1, length - 1);
+  }
+}
+
+static mrb_value
+mrb_pq_json_new(mrb_state *mrb, struct RClass *json_class, const char *value, int length)
+{
+  mrb_value json = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_OBJECT, json_class));
+  mrb_iv_set(mrb, json, mrb_intern_lit(mrb, "@raw"), mrb_str_new(mrb, value, length));
+
+  return json;
+}
+
+static struct RClass *
+mrb_pq_json_class(mrb_state *mrb, const mrb_pq_decoder *decoder)
+{
+  if (likely(decoder && mrb_class_p(decoder->data))) {
+    return mrb_class_ptr(decoder->data);
+  }
+  return mrb_class_get_under(mrb, mrb_class_get(mrb, "Pq"), "JSON");
+}
+
+// keeps the text and only parses it when it's accessed
+static mrb_value
+mrb_pq_decode_text_json_lazy(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_pq_json_new(mrb, mrb_pq_json_class(mrb, decoder), value, length);
+}
+
+static mrb_value
+mrb_pq_decode_binary_jsonb_lazy(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length < 1 || value[0] != 1)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  return mrb_pq_json_new(mrb, mrb_pq_json_class(mrb, decoder), value + 1, length - 1);
+}
+
+static mrb_value
+mrb_pq_decode_binary_jsonb_raw(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (unlikely(length < 1 || value[0] != 1)) {
+    return mrb_pq_decode_string(mrb, value, length, decoder);
+  }
+  return mrb_str_new(mrb, value + 1, length - 1);
+}
+
+static mrb_pq_decode_func
+mrb_pq_json_decoder(mrb_pq_decode_func func, int json_mode)
+{
+  if (func == mrb_pq_decode_text_json) {
+    switch (json_mode) {
+      case MRB_PQ_JSON_LAZY: return mrb_pq_decode_text_json_lazy;
+      case MRB_PQ_JSON_RAW: return mrb_pq_decode_string;
+    }
+  } else if (func == mrb_pq_decode_binary_jsonb) {
+    switch (json_mode) {
+      case MRB_PQ_JSON_LAZY: return mrb_pq_decode_binary_jsonb_lazy;
+      case MRB_PQ_JSON_RAW: return mrb_pq_decode_binary_jsonb_raw;
+    }
+  }
+  return func;
+}
+
+static const char *
+mrb_pq_json_skip_space(const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+    p++;
+  }
+  return p;
+}
+
+// p points at the opening quote, returns the position after the closing one
+static const char *
+mrb_pq_json_skip_string(const char *p, const char *end)
+{
+  for (p++; p < end; p++) {
+    if (*p == '\\') {
+      p++;
+    } else if (*p == '"') {
+      return p + 1;
+    }
+  }
+  return NULL;
+}
+
+static const char *
+mrb_pq_json_skip_value(const char *p, const char *end)
+{
+  if (p >= end) {
+    return NULL;
+  }
+  if (*p == '"') {
+    return mrb_pq_json_skip_string(p, end);
+  }
+  if (*p == '{' || *p == '[') {
+    int depth = 0;
+    while (p < end) {
+      switch (*p) {
+        case '"': {
+          p = mrb_pq_json_skip_string(p, end);
+          if (unlikely(!p)) {
+            return NULL;
+          }
+          continue;
+        }
+        case '{':
+        case '[':
+          depth++;
+          break;
+        case '}':
+        case ']':
+          if (--depth == 0) {
+            return p + 1;
+          }
+          break;
+      }
+      p++;
+    }
+    return NULL;
+  }
+  while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+    p++;
+  }
+  return p;
+}
+
+static int
+mrb_pq_json_hex(const char *p)
+{
+  int code = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = p[i];
+    code <<= 4;
+    if (c >= '0' && c <= '9') code |= c - '0';
+    else if (c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+    else return -1;
+  }
+  return code;
+}
+
+// unescapes the contents of a json string, p and end exclude the quotes
+static mrb_value
+mrb_pq_json_string(mrb_state *mrb, const char *p, const char *end)
+{
+  const char *backslash = (const char *) memchr(p, '\\', end - p);
+  if (likely(!backslash)) {
+    return mrb_str_new(mrb, p, end - p);
+  }
+  mrb_value str = mrb_str_buf_new(mrb, end - p);
+  while (backslash) {
+    mrb_str_cat(mrb, str, p, backslash - p);
+    p = backslash + 1;
+    if (unlikely(p >= end)) {
+      break;
+    }
+    char c = *p++;
+    switch (c) {
+      case 'b': mrb_str_cat_lit(mrb, str, "\b"); break;
+      case 'f': mrb_str_cat_lit(mrb, str, "\f"); break;
+      case 'n': mrb_str_cat_lit(mrb, str, "\n"); break;
+      case 'r': mrb_str_cat_lit(mrb, str, "\r"); break;
+      case 't': mrb_str_cat_lit(mrb, str, "\t"); break;
+      case 'u': {
+        int code = end - p >= 4 ? mrb_pq_json_hex(p) : -1;
+        if (unlikely(code < 0)) {
+          mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid unicode escape in json");
+        }
+        p += 4;
+        if (code >= 0xD800 && code <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+          int low = mrb_pq_json_hex(p + 2);
+          if (low >= 0xDC00 && low <= 0xDFFF) {
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            p += 6;
+          }
+        }
+        char utf8[4];
+        int length;
+        if (code < 0x80) {
+          utf8[0] = (char) code;
+          length = 1;
+        } else if (code < 0x800) {
+          utf8[0] = (char) (0xC0 | (code >> 6));
+          utf8[1] = (char) (0x80 | (code & 0x3F));
+          length = 2;
+        } else if (code < 0x10000) {
+          utf8[0] = (char) (0xE0 | (code >> 12));
+          utf8[1] = (char) (0x80 | ((code >> 6) & 0x3F));
+          utf8[2] = (char) (0x80 | (code & 0x3F));
+          length = 3;
+        } else {
+          utf8[0] = (char) (0xF0 | (code >> 18));
+          utf8[1] = (char) (0x80 | ((code >> 12) & 0x3F));
+          utf8[2] = (char) (0x80 | ((code >> 6) & 0x3F));
+          utf8[3] = (char) (0x80 | (code & 0x3F));
+          length = 4;
+        }
+        mrb_str_cat(mrb, str, utf8, length);
+      } break;
+      default: // " \ and /
+        mrb_str_cat(mrb, str, &c, 1);
+    }
+    backslash = (const char *) memchr(p, '\\', end - p);
+  }
+  mrb_str_cat(mrb, str, p, end - p);
+
+  return str;
+}
+
+// p points at the opening brace, returns the start of the value of key or NULL
+static const char *
+mrb_pq_json_member(mrb_state *mrb, const char *p, const char *end, const char *key, mrb_int key_length)
+{
+  p++;
+  for (;;) {
+    p = mrb_pq_json_skip_space(p, end);
+    if (p >= end || *p != '"') {
+      return NULL;
+    }
+    const char *key_end = mrb_pq_json_skip_string(p, end);
+    if (unlikely(!key_end)) {
+      return NULL;
+    }
+    mrb_bool match;
+    if (memchr(p + 1, '\\', key_end - p - 2)) {
+      mrb_value unescaped = mrb_pq_json_string(mrb, p + 1, key_end - 1);
+      match = RSTRING_LEN(unescaped) == key_length && memcmp(RSTRING_PTR(unescaped), key, key_length) == 0;
+    } else {
+      match = key_end - p - 2 == key_length && memcmp(p + 1, key, key_length) == 0;
+    }
+    p = mrb_pq_json_skip_space(key_end, end);
+    if (p >= end || *p != ':') {
+      return NULL;
+    }
+    p = mrb_pq_json_skip_space(p + 1, end);
+    if (match) {
+      return p;
+    }
+    p = mrb_pq_json_skip_value(p, end);
+    if (unlikely(!p)) {
+      return NULL;
+    }
+    p = mrb_pq_json_skip_space(p, end);
+    if (p >= end || *p != ',') {
+      return NULL;
+    }
+    p++;
+  }
+}
+
+// p points at the opening bracket, returns the start of the element at index or NULL
+static const char *
+mrb_pq_json_element(const char *p, const char *end, mrb_int index)
+{
+  if (index < 0) {
+    mrb_int count = 0;
+    const char *q = mrb_pq_json_skip_space(p + 1, end);
+    while (q < end && *q != ']') {
+      q = mrb_pq_json_skip_value(q, end);
+      if (unlikely(!q)) {
+        return NULL;
+      }
+      count++;
+      q = mrb_pq_json_skip_space(q, end);
+      if (q < end && *q == ',') {
+        q = mrb_pq_json_skip_space(q + 1, end);
+      }
+    }
+    index += count;
+    if (index < 0) {
+      return NULL;
+    }
+  }
+  p = mrb_pq_json_skip_space(p + 1, end);
+  if (p >= end || *p == ']') {
+    return NULL;
+  }
+  for (mrb_int i = 0; i < index; i++) {
+    p = mrb_pq_json_skip_value(p, end);
+    if (unlikely(!p)) {
+      return NULL;
+    }
+    p = mrb_pq_json_skip_space(p, end);
+    if (p >= end || *p != ',') {
+      return NULL;
+    }
+    p = mrb_pq_json_skip_space(p + 1, end);
+  }
+  return p;
+}
+
+static mrb_value
+mrb_pq_json_value(mrb_state *mrb, mrb_value self, const char *p, const char *end)
+{
+  switch (*p) {
+    case '"':
+      return mrb_pq_json_string(mrb, p + 1, end - 1);
+    case '{':
+    case '[':
+      return mrb_pq_json_new(mrb, mrb_obj_class(mrb, self), p, (int) (end - p));
+    case 't':
+      return mrb_true_value();
+    case 'f':
+      return mrb_false_value();
+    case 'n':
+      return mrb_nil_value();
+    default: {
+      // the raw string is NUL terminated, so strtod and strtoll stop at the end of it at the latest
+      if (memchr(p, '.', end - p) || memchr(p, 'e', end - p) || memchr(p, 'E', end - p)) {
+#ifndef MRB_WITHOUT_FLOAT
+        return mrb_float_value(mrb, strtod(p, NULL));
+#else
+        return mrb_str_new(mrb, p, end - p);
+#endif
+      }
+      errno = 0;
+      long long number = strtoll(p, NULL, 10);
+      if (unlikely(errno == ERANGE || number < MRB_INT_MIN || number > MRB_INT_MAX)) {
+#ifndef MRB_WITHOUT_FLOAT
+        return mrb_float_value(mrb, strtod(p, NULL));
+#else
+        return mrb_str_new(mrb, p, end - p);
+#endif
+      }
+      return mrb_int_value(mrb, (mrb_int) number);
+    }
+  }
+}
+
+// walks the raw text to the value, objects and arrays are returned as Pq::JSON again
+static mrb_value
+mrb_pq_json_dig(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *keys;
+  mrb_int nkeys;
+  mrb_get_args(mrb, "*", &keys, &nkeys);
+  if (unlikely(nkeys == 0)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (given 0, expected 1+)");
+  }
+  mrb_value raw = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@raw"));
+  if (unlikely(!mrb_string_p(raw))) {
+    return mrb_nil_value();
+  }
+  const char *p = RSTRING_PTR(raw);
+  const char *end = p + RSTRING_LEN(raw);
+
+  for (mrb_int i = 0; i < nkeys; i++) {
+    p = mrb_pq_json_skip_space(p, end);
+    if (p >= end) {
+      return mrb_nil_value();
+    }
+    switch (mrb_type(keys[i])) {
+      case MRB_TT_STRING: {
+        p = *p == '{' ? mrb_pq_json_member(mrb, p, end, RSTRING_PTR(keys[i]), RSTRING_LEN(keys[i])) : NULL;
+      } break;
+      case MRB_TT_SYMBOL: {
+        mrb_int key_length;
+        const char *key = mrb_sym_name_len(mrb, mrb_symbol(keys[i]), &key_length);
+        p = *p == '{' ? mrb_pq_json_member(mrb, p, end, key, key_length) : NULL;
+      } break;
+      case MRB_TT_INTEGER: {
+        p = *p == '[' ? mrb_pq_json_element(p, end, mrb_integer(keys[i])) : NULL;
+      } break;
+      default:
+        mrb_raisef(mrb, E_TYPE_ERROR, "can't dig into json with %T", keys[i]);
+    }
+    if (!p) {
+      return mrb_nil_value();
+    }
+  }
+  const char *value_end = mrb_pq_json_skip_value(p, end);
+  if (unlikely(!value_end || value_end == p)) {
+    return mrb_nil_value();
+  }
+
+  return mrb_pq_json_value(mrb, self, p, value_end);
+}
+
+static mrb_pq_decode_func
+mrb_pq_binary_decoder(Oid type)
+{
+  switch(type) {
+    case 16: // bool
+      return mrb_pq_decode_binary_bool;
+    case 20: // int64_t
+      return mrb_pq_decode_binary_int64;
+    case 23: // int32_t
+      return mrb_pq_decode_binary_int32;
+    case 21: // int16_t
+      return mrb_pq_decode_binary_int16;
+    case 26: // oid
+      return mrb_pq_decode_binary_oid;
+#ifndef MRB_WITHOUT_FLOAT
+    case 700: // float
+      return mrb_pq_decode_binary_float;
+    case 701: // double
+      return mrb_pq_decode_binary_double;
+#endif
+    case 1700: // numeric
+      return mrb_pq_decode_binary_numeric;
+    case 2950: // uuid
+      return mrb_pq_decode_binary_uuid;
+    case 1082: // date
+      return mrb_pq_decode_binary_date;
+    case 1114: // timestamp
+      return mrb_pq_decode_binary_timestamp;
+    case 1184: // timestamptz
+      return mrb_pq_decode_binary_timestamptz;
+    case 1083: // time
+      return mrb_pq_decode_binary_time;
+    case 1186: // interval
+      return mrb_pq_decode_binary_interval;
+    case 114: // json is sent as text
+      return mrb_pq_decode_text_json;
+    case 3802:
+      return mrb_pq_decode_binary_jsonb;
+    case 2249: // record
+      return mrb_pq_decode_binary_record;
+    default:
+      return mrb_pq_decode_string;
+  }
+}
+
+#ifdef MRB_PQ_STRING_VIEWS
+// a frozen String pointing into the PGresult, it references the owner string, whose class keeps the Pq::Result alive
+static mrb_value
+mrb_pq_decode_string_view(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  if (length < decoder->string_views) {
+    return mrb_str_new(mrb, value, length);
+  }
+  struct RString *view = (struct RString *) mrb_obj_alloc(mrb, MRB_TT_STRING, mrb->string_class);
+  view->as.heap.ptr = (char *) value;
+  view->as.heap.len = length;
+  view->as.heap.aux.fshared = mrb_str_ptr(decoder->data);
+  RSTR_SET_FSHARED_FLAG(view);
+  MRB_SET_FROZEN_FLAG(view);
+
+  return mrb_obj_value(view);
+}
+
+// strings can't have instance variables, so the result is attached to a class of its own, substrings and copies of views share the owner
+static mrb_value
+mrb_pq_string_view_owner(mrb_state *mrb, mrb_value self)
+{
+  mrb_value owner = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@string_view_owner"));
+  if (!mrb_string_p(owner)) {
+    struct RClass *owner_class = mrb_class_new(mrb, mrb->string_class);
+    mrb_iv_set(mrb, mrb_obj_value(owner_class), mrb_intern_lit(mrb, "@result"), self);
+    owner = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_STRING, owner_class));
+    mrb_obj_freeze(mrb, owner);
+    mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@string_view_owner"), owner);
+  }
+
+  return owner;
+}
+#endif
+
+static mrb_value
+mrb_pq_decode_with_proc(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder)
+{
+  return mrb_yield(mrb, decoder->data, mrb_str_new(mrb, value, length));
+}
+
+static mrb_value
+mrb_pq_type_proc(mrb_state *mrb, mrb_value types, Oid oid)
+{
+  return mrb_hash_get(mrb, mrb_iv_get(mrb, types, mrb_intern_lit(mrb, "@decoders")), mrb_int_value(mrb, oid));
+}
+
+// self is the Pq::Result, its @types is the Pq::TypeRegistry of the connection or nil
+static mrb_pq_decoder
+mrb_pq_decoder_for(mrb_state *mrb, mrb_value self, const PGresult *result, int column_number)
+{
+  mrb_pq_decoder decoder = { NULL, NULL, mrb_nil_value(), 0, FALSE };
+  int format = PQfformat(result, column_number);
+  Oid type = PQftype(result, column_number);
+  Oid element_type = 0;
+  int json_mode = MRB_PQ_JSON_LAZY;
+  mrb_value types = mrb_pq_types(mrb, self);
+  const mrb_pq_type_registry *registry = NULL;
+  if (!mrb_nil_p(types)) {
+    registry = DATA_GET_PTR(mrb, types, &mrb_pq_type_registry_type, mrb_pq_type_registry);
+    json_mode = registry->json_mode;
+    decoder.epoch_usec = registry->epoch_usec;
+    const mrb_pq_type *entry = mrb_pq_type_lookup(registry, type);
+    if (entry) {
+      if (entry->proc_type) {
+        decoder.func = mrb_pq_decode_with_proc;
+        decoder.data = mrb_pq_type_proc(mrb, types, entry->proc_type);
+        return decoder;
+      }
+      type = entry->target;
+      entry = mrb_pq_type_lookup(registry, type);
+      if (entry && entry->element) {
+        const mrb_pq_type *element = mrb_pq_type_lookup(registry, entry->element);
+        if (element && element->proc_type) {
+          decoder.func = format == 0 ? mrb_pq_decode_text_array : mrb_pq_decode_binary_array;
+          decoder.element = mrb_pq_decode_with_proc;
+          decoder.data = mrb_pq_type_proc(mrb, types, element->proc_type);
+          return decoder;
+        }
+        element_type = element ? element->target : entry->element;
+      }
+    }
+  }
+  if (!element_type) {
+    element_type = mrb_pq_array_element_type(type);
+  }
+  if (format == 0) {
+    if (element_type) {
+      decoder.func = mrb_pq_decode_text_array;
+      decoder.element = mrb_pq_text_decoder(element_type);
+    } else {
+      decoder.func = mrb_pq_text_decoder(type);
+    }
+  } else {
+    if (element_type) {
+      decoder.func = mrb_pq_decode_binary_array;
+      decoder.element = mrb_pq_binary_decoder(element_type);
+    } else {
+      decoder.func = mrb_pq_binary_decoder(type);
+    }
+  }
+  if (json_mode != MRB_PQ_JSON_PARSE) {
+    decoder.func = mrb_pq_json_decoder(decoder.func, json_mode);
+    if (decoder.element) {
+      decoder.element = mrb_pq_json_decoder(decoder.element, json_mode);
+    }
+    if (decoder.func == mrb_pq_decode_text_json_lazy || decoder.func == mrb_pq_decode_binary_jsonb_lazy ||
+      decoder.element == mrb_pq_decode_text_json_lazy || decoder.element == mrb_pq_decode_binary_jsonb_lazy) {
+      decoder.data = mrb_obj_value(mrb_pq_json_class(mrb, NULL));
+    }
+  }
+#ifdef MRB_PQ_STRING_VIEWS
+  if (registry && registry->string_views && decoder.func == mrb_pq_decode_string) {
+    decoder.func = mrb_pq_decode_string_view;
+    decoder.data = mrb_pq_string_view_owner(mrb, self);
+    decoder.string_views = registry->string_views;
+  }
+#endif
+
+  return decoder;
+}
+
+static inline mrb_value
+mrb_pq_decode(mrb_state *mrb, const PGresult *result, int row_number, int column_number, const mrb_pq_decoder *decoder)
+{
+  return decoder->func(mrb, PQgetvalue(result, row_number, column_number), PQgetlength(result, row_number, column_number), decoder);
+}
+
+static mrb_value
+mrb_PQgetvalue(mrb_state *mrb, mrb_value self)
+{
+  mrb_int row_number, column_number;
+  mrb_get_args(mrb, "ii", &row_number, &column_number);
+  mrb_assert_int_fit(mrb_int, row_number, int, INT_MAX);
+  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
+
+  char *value = PQgetvalue(result, (int) row_number, (int) column_number);
+  if (value) {
+    if (PQgetisnull(result, (int) row_number, (int) column_number)) {
+      return mrb_symbol_value(mrb_intern_lit(mrb, "NULL"));
+    } else {
+      mrb_pq_decoder decoder = mrb_pq_decoder_for(mrb, self, result, (int) column_number);
+      return mrb_pq_decode(mrb, result, (int) row_number, (int) column_number, &decoder);
+    }
+  } else {
+    return mrb_nil_value();
+  }
+}
+
+// the stats of the query which returned the result, NULL unless its connection collects them
+static inline mrb_pq_query_stats *
+mrb_pq_result_stats(mrb_state *mrb, mrb_value self)
+{
+  return mrb_pq_query_stats_ptr(mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@stats")));
+}
+
+static void
+mrb_pq_resolve_decoders(mrb_state *mrb, mrb_value self, const PGresult *result, int nfields, mrb_pq_decoder *decoders)
+{
+  for (int column_number = 0; column_number < nfields; column_number++) {
+    decoders[column_number] = mrb_pq_decoder_for(mrb, self, result, column_number);
+  }
+}
+
+static mrb_value
+mrb_pq_result_row(mrb_state *mrb, const PGresult *result, int row_number, int nfields, const mrb_pq_decoder *decoders, mrb_value null_value)
+{
+  mrb_value row = mrb_ary_new_capa(mrb, nfields);
+  for (int column_number = 0; column_number < nfields; column_number++) {
+    if (PQgetisnull(result, row_number, column_number)) {
+      mrb_ary_push(mrb, row, null_value);
     } else {
-      mrb_sys_fail(mrb, PQresultErrorMessage(res));
+      mrb_ary_push(mrb, row, mrb_pq_decode(mrb, result, row_number, column_number, &decoders[column_number]));
     }
   }
 
-  return self;
+  return row;
+}
+
+static mrb_value
+mrb_pq_result_names(mrb_state *mrb, mrb_value self)
+{
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
+  int nfields = PQnfields(result);
+  mrb_value names = mrb_ary_new_capa(mrb, nfields);
+  for (int column_number = 0; column_number < nfields; column_number++) {
+    mrb_ary_push(mrb, names, mrb_str_new_cstr(mrb, PQfname(result, column_number)));
+  }
 
+  return names;
 }
 
 static mrb_value
-mrb_PQdescribePrepared(mrb_state *mrb, mrb_value self)
+mrb_pq_result_values(mrb_state *mrb, mrb_value self)
 {
-  const char *stmtName = NULL;
-  mrb_get_args(mrb, "|z!", &stmtName);
-  PGconn *conn = (PGconn *) DATA_PTR(self);
-  if (!conn) {
-    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
+  mrb_pq_query_stats *stats = mrb_pq_result_stats(mrb, self);
+  uint64_t started = stats ? mrb_pq_clock_ns() : 0;
+  int ntuples = PQntuples(result);
+  int nfields = PQnfields(result);
+  mrb_pq_decoder decoders[nfields > 0 ? nfields : 1];
+  mrb_pq_resolve_decoders(mrb, self, result, nfields, decoders);
+  mrb_value null_value = mrb_symbol_value(mrb_intern_lit(mrb, "NULL"));
+  mrb_value rows = mrb_ary_new_capa(mrb, ntuples);
+
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (int row_number = 0; row_number < ntuples; row_number++) {
+    mrb_ary_push(mrb, rows, mrb_pq_result_row(mrb, result, row_number, nfields, decoders, null_value));
+    mrb_gc_arena_restore(mrb, arena_index);
   }
 
-  errno = 0;
-  PGresult *res = PQdescribePrepared(conn, stmtName);
-  if (likely(res)) {
-    return mrb_pq_result_processor(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result"), res);
-  } else {
-    mrb_sys_fail(mrb, PQresultErrorMessage(res));
+  if (stats) {
+    stats->decode_ns += mrb_pq_clock_ns() - started;
   }
 
-  return self;
+  return rows;
 }
 
 static mrb_value
-mrb_PQdescribePortal(mrb_state *mrb, mrb_value self)
+mrb_pq_result_each_row(mrb_state *mrb, mrb_value self)
 {
-  const char *portalName = NULL;
-  mrb_get_args(mrb, "|z!", &portalName);
-  PGconn *conn = (PGconn *) DATA_PTR(self);
-  if (!conn) {
-    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  mrb_value block = mrb_nil_value();
+  mrb_get_args(mrb, "&", &block);
+  if (mrb_nil_p(block)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
   }
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
+  mrb_pq_query_stats *stats = mrb_pq_result_stats(mrb, self);
+  uint64_t decode_ns = 0, started = stats ? mrb_pq_clock_ns() : 0;
+  int ntuples = PQntuples(result);
+  int nfields = PQnfields(result);
+  mrb_pq_decoder decoders[nfields > 0 ? nfields : 1];
+  mrb_pq_resolve_decoders(mrb, self, result, nfields, decoders);
+  mrb_value null_value = mrb_symbol_value(mrb_intern_lit(mrb, "NULL"));
 
-  errno = 0;
-  PGresult *res = PQdescribePortal(conn, portalName);
-  if (likely(res)) {
-    return mrb_pq_result_processor(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Result"), res);
-  } else {
-    mrb_sys_fail(mrb, PQresultErrorMessage(res));
+  if (stats) {
+    decode_ns = mrb_pq_clock_ns() - started;
+  }
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (int row_number = 0; row_number < ntuples; row_number++) {
+    if (stats) {
+      started = mrb_pq_clock_ns();
+    }
+    mrb_value row = mrb_pq_result_row(mrb, result, row_number, nfields, decoders, null_value);
+    if (stats) {
+      decode_ns += mrb_pq_clock_ns() - started;
+    }
+    mrb_yield(mrb, block, row);
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+  if (stats) {
+    stats->decode_ns += decode_ns;
   }
 
   return self;
 }
 
-static void
-mrb_PQnoticeReceiver(void *arg_, const PGresult *res)
+static mrb_value
+mrb_pq_result_map_rows(mrb_state *mrb, mrb_value self)
 {
-  mrb_PQnoticeReceiver_arg *arg = (mrb_PQnoticeReceiver_arg *) arg_;
-  int arena_index = mrb_gc_arena_save(arg->mrb);
-  mrb_yield(arg->mrb, arg->block, mrb_pq_result_processor(arg->mrb, arg->pq_result_class, res));
-  mrb_gc_arena_restore(arg->mrb, arena_index);
+  mrb_value block = mrb_nil_value();
+  mrb_get_args(mrb, "&", &block);
+  if (mrb_nil_p(block)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
+  mrb_pq_query_stats *stats = mrb_pq_result_stats(mrb, self);
+  uint64_t decode_ns = 0, started = stats ? mrb_pq_clock_ns() : 0;
+  int ntuples = PQntuples(result);
+  int nfields = PQnfields(result);
+  mrb_pq_decoder decoders[nfields > 0 ? nfields : 1];
+  mrb_pq_resolve_decoders(mrb, self, result, nfields, decoders);
+  mrb_value null_value = mrb_symbol_value(mrb_intern_lit(mrb, "NULL"));
+  mrb_value mapped = mrb_ary_new_capa(mrb, ntuples);
+
+  if (stats) {
+    decode_ns = mrb_pq_clock_ns() - started;
+  }
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (int row_number = 0; row_number < ntuples; row_number++) {
+    if (stats) {
+      started = mrb_pq_clock_ns();
+    }
+    mrb_value row = mrb_pq_result_row(mrb, result, row_number, nfields, decoders, null_value);
+    if (stats) {
+      decode_ns += mrb_pq_clock_ns() - started;
+    }
+    mrb_ary_push(mrb, mapped, mrb_yield(mrb, block, row));
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+  if (stats) {
+    stats->decode_ns += decode_ns;
+  }
+
+  return mapped;
 }
 
 static mrb_value
-mrb_PQsetNoticeReceiver(mrb_state *mrb, mrb_value self)
+mrb_pq_result_each_hash(mrb_state *mrb, mrb_value self)
 {
   mrb_value block = mrb_nil_value();
   mrb_get_args(mrb, "&", &block);
   if (mrb_nil_p(block)) {
     mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
   }
-  if (mrb_type(block) != MRB_TT_PROC) {
-    mrb_raise(mrb, E_TYPE_ERROR, "not a block");
-  }
-  PGconn *conn = (PGconn *) DATA_PTR(self);
-  if (!conn) {
-    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
+  mrb_pq_query_stats *stats = mrb_pq_result_stats(mrb, self);
+  uint64_t decode_ns = 0, started = stats ? mrb_pq_clock_ns() : 0;
+  int ntuples = PQntuples(result);
+  int nfields = PQnfields(result);
+  mrb_pq_decoder decoders[nfields > 0 ? nfields : 1];
+  mrb_pq_resolve_decoders(mrb, self, result, nfields, decoders);
+  mrb_value null_value = mrb_symbol_value(mrb_intern_lit(mrb, "NULL"));
+  // frozen keys are shared by every hash instead of being copied into each of them
+  mrb_value names = mrb_pq_result_names(mrb, self);
+  for (int column_number = 0; column_number < nfields; column_number++) {
+    mrb_obj_freeze(mrb, RARRAY_PTR(names)[column_number]);
   }
 
-  struct RClass *pq_class = mrb_obj_class(mrb, self);
-  struct RClass *pq_result_class = mrb_class_get_under(mrb, pq_class, "Result");
-  mrb_PQnoticeReceiver_arg *arg;
-  struct RData *notice_receiver_data;
-  Data_Make_Struct(mrb, mrb_class_get_under(mrb, pq_class, "NoticeReceiver"), mrb_PQnoticeReceiver_arg, &mrb_PQnoticeReceiver_type, arg, notice_receiver_data);
-  arg->mrb = mrb;
-  arg->pq_result_class = pq_result_class;
-  arg->block = block;
-  mrb_value notice_receiver = mrb_obj_value(notice_receiver_data);
-  mrb_iv_set(mrb, notice_receiver, mrb_intern_lit(mrb, "block"), block);
-  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "notice_receiver"), notice_receiver);
-
-  PQsetNoticeReceiver(conn, mrb_PQnoticeReceiver, arg);
+  if (stats) {
+    decode_ns = mrb_pq_clock_ns() - started;
+  }
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (int row_number = 0; row_number < ntuples; row_number++) {
+    if (stats) {
+      started = mrb_pq_clock_ns();
+    }
+    mrb_value hash = mrb_hash_new_capa(mrb, nfields);
+    for (int column_number = 0; column_number < nfields; column_number++) {
+      if (PQgetisnull(result, row_number, column_number)) {
+        mrb_hash_set(mrb, hash, RARRAY_PTR(names)[column_number], null_value);
+      } else {
+        mrb_hash_set(mrb, hash, RARRAY_PTR(names)[column_number], mrb_pq_decode(mrb, result, row_number, column_number, &decoders[column_number]));
+      }
+    }
+    if (stats) {
+      decode_ns += mrb_pq_clock_ns() - started;
+    }
+    mrb_yield(mrb, block, hash);
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+  if (stats) {
+    stats->decode_ns += decode_ns;
+  }
 
   return self;
 }
 
 static mrb_value
-mrb_PQntuples(mrb_state *mrb, mrb_value self)
+mrb_pq_record_field(mrb_state *mrb, mrb_value self)
 {
-  return mrb_int_value(mrb, PQntuples((const PGresult *) DATA_PTR(self)));
+  return mrb_ary_entry(self, mrb_integer(mrb_proc_cfunc_env_get(mrb, 0)));
 }
 
+// Record#[] also takes column names, Integers are looked up like in Array#[] without going through Ruby
 static mrb_value
-mrb_PQnfields(mrb_state *mrb, mrb_value self)
+mrb_pq_record_aref(mrb_state *mrb, mrb_value self)
 {
-  return mrb_int_value(mrb, PQnfields((const PGresult *) DATA_PTR(self)));
+  const mrb_value *argv;
+  mrb_int argc;
+  mrb_get_args(mrb, "*", &argv, &argc);
+  if (argc == 1) {
+    if (mrb_integer_p(argv[0])) {
+      return mrb_ary_entry(self, mrb_integer(argv[0]));
+    }
+    if (mrb_symbol_p(argv[0]) || mrb_string_p(argv[0])) {
+      mrb_sym name = mrb_symbol_p(argv[0]) ? mrb_symbol(argv[0]) : mrb_intern_str(mrb, argv[0]);
+      mrb_value offsets = mrb_iv_get(mrb, mrb_obj_value(mrb_obj_class(mrb, self)), mrb_intern_lit(mrb, "@offsets"));
+      mrb_value offset = mrb_hash_p(offsets) ? mrb_hash_get(mrb, offsets, mrb_symbol_value(name)) : mrb_nil_value();
+      if (!mrb_integer_p(offset)) {
+        mrb_raisef(mrb, E_NAME_ERROR, "no member '%n' in record", name);
+      }
+      return mrb_ary_entry(self, mrb_integer(offset));
+    }
+  }
+
+  return mrb_funcall_argv(mrb, self, mrb_intern_lit(mrb, "slice"), argc, argv);
 }
 
-static mrb_value
-mrb_PQfname(mrb_state *mrb, mrb_value self)
+// generated Record classes kept per connection, the oldest one is dropped when a new column layout doesn't fit anymore
+#ifndef MRB_PQ_RECORD_CLASSES
+#define MRB_PQ_RECORD_CLASSES 256
+#endif
+
+// one Pq::Record subclass per combination of column names and types, cached in the type registry of the connection
+static struct RClass *
+mrb_pq_record_class(mrb_state *mrb, mrb_value self, const PGresult *result, int nfields)
 {
-  mrb_int column_number;
-  mrb_get_args(mrb, "i", &column_number);
-  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
+  mrb_value key = mrb_str_buf_new(mrb, nfields * 16);
+  for (int column_number = 0; column_number < nfields; column_number++) {
+    char oid[4];
+    mrb_str_cat_cstr(mrb, key, PQfname(result, column_number));
+    mrb_pq_write_uint32(oid, PQftype(result, column_number));
+    mrb_str_cat(mrb, key, "", 1);
+    mrb_str_cat(mrb, key, oid, sizeof(oid));
+  }
+  mrb_value types = mrb_pq_types(mrb, self);
+  mrb_value cache = mrb_nil_p(types) ? mrb_nil_value() : mrb_iv_get(mrb, types, mrb_intern_lit(mrb, "@record_classes"));
+  if (mrb_hash_p(cache)) {
+    mrb_value record_class = mrb_hash_get(mrb, cache, key);
+    if (mrb_class_p(record_class)) {
+      return mrb_class_ptr(record_class);
+    }
+  }
 
-  char *fname = PQfname((const PGresult *) DATA_PTR(self), (int) column_number);
-  if (fname) {
-    return mrb_str_new_cstr(mrb, fname);
-  } else {
-    return mrb_nil_value();
+  struct RClass *record_class = mrb_class_new(mrb, mrb_class_get_under(mrb, mrb_class_get(mrb, "Pq"), "Record"));
+  MRB_SET_INSTANCE_TT(record_class, MRB_TT_ARRAY);
+  mrb_value members = mrb_ary_new_capa(mrb, nfields);
+  mrb_value offsets = mrb_hash_new_capa(mrb, nfields);
+  for (int column_number = 0; column_number < nfields; column_number++) {
+    mrb_sym name = mrb_intern_cstr(mrb, PQfname(result, column_number));
+    mrb_value offset = mrb_int_value(mrb, column_number);
+    mrb_ary_push(mrb, members, mrb_symbol_value(name));
+    if (mrb_hash_key_p(mrb, offsets, mrb_symbol_value(name))) {
+      continue;
+    }
+    mrb_hash_set(mrb, offsets, mrb_symbol_value(name), offset);
+    // columns named like existing methods, e.g. size or class, are only reachable with []
+    if (!mrb_obj_respond_to(mrb, record_class, name)) {
+      mrb_method_t method;
+      MRB_METHOD_FROM_PROC(method, mrb_proc_new_cfunc_with_env(mrb, mrb_pq_record_field, 1, &offset));
+      mrb_define_method_raw(mrb, record_class, name, method);
+    }
+  }
+  mrb_obj_freeze(mrb, members);
+  mrb_iv_set(mrb, mrb_obj_value(record_class), mrb_intern_lit(mrb, "@members"), members);
+  mrb_iv_set(mrb, mrb_obj_value(record_class), mrb_intern_lit(mrb, "@offsets"), offsets);
+  if (mrb_hash_p(cache)) {
+    if (mrb_hash_size(mrb, cache) >= MRB_PQ_RECORD_CLASSES) {
+      mrb_funcall(mrb, cache, "shift", 0);
+    }
+    mrb_hash_set(mrb, cache, key, mrb_obj_value(record_class));
   }
+
+  return record_class;
 }
 
 static mrb_value
-mrb_PQfnumber(mrb_state *mrb, mrb_value self)
+mrb_pq_result_record(mrb_state *mrb, struct RClass *record_class, const PGresult *result, int row_number, int nfields, const mrb_pq_decoder *decoders, mrb_value null_value)
 {
-  const char *column_name;
-  mrb_get_args(mrb, "z", &column_name);
+  mrb_value record = mrb_obj_value(mrb_obj_alloc(mrb, MRB_TT_ARRAY, record_class));
+  mrb_ary_resize(mrb, record, nfields);
+  for (int column_number = 0; column_number < nfields; column_number++) {
+    if (PQgetisnull(result, row_number, column_number)) {
+      mrb_ary_set(mrb, record, column_number, null_value);
+    } else {
+      mrb_ary_set(mrb, record, column_number, mrb_pq_decode(mrb, result, row_number, column_number, &decoders[column_number]));
+    }
+  }
 
-  int fnumber = PQfnumber((const PGresult *) DATA_PTR(self), column_name);
-  if (fnumber != -1) {
-    return mrb_int_value(mrb, fnumber);
-  } else {
-    return mrb_nil_value();
+  return record;
+}
+
+static mrb_value
+mrb_pq_result_each_record(mrb_state *mrb, mrb_value self)
+{
+  mrb_value block = mrb_nil_value();
+  mrb_get_args(mrb, "&", &block);
+  if (mrb_nil_p(block)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
+  mrb_pq_query_stats *stats = mrb_pq_result_stats(mrb, self);
+  uint64_t decode_ns = 0, started = stats ? mrb_pq_clock_ns() : 0;
+  int ntuples = PQntuples(result);
+  int nfields = PQnfields(result);
+  mrb_pq_decoder decoders[nfields > 0 ? nfields : 1];
+  mrb_pq_resolve_decoders(mrb, self, result, nfields, decoders);
+  mrb_value null_value = mrb_symbol_value(mrb_intern_lit(mrb, "NULL"));
+  struct RClass *record_class = mrb_pq_record_class(mrb, self, result, nfields);
+
+  if (stats) {
+    decode_ns = mrb_pq_clock_ns() - started;
   }
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (int row_number = 0; row_number < ntuples; row_number++) {
+    if (stats) {
+      started = mrb_pq_clock_ns();
+    }
+    mrb_value record = mrb_pq_result_record(mrb, record_class, result, row_number, nfields, decoders, null_value);
+    if (stats) {
+      decode_ns += mrb_pq_clock_ns() - started;
+    }
+    mrb_yield(mrb, block, record);
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+  if (stats) {
+    stats->decode_ns += decode_ns;
+  }
+
+  return self;
 }
 
 static mrb_value
-mrb_PQftable(mrb_state *mrb, mrb_value self)
+mrb_pq_result_to_records(mrb_state *mrb, mrb_value self)
 {
-  mrb_int column_number;
-  mrb_get_args(mrb, "i", &column_number);
-  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
+  mrb_pq_query_stats *stats = mrb_pq_result_stats(mrb, self);
+  uint64_t started = stats ? mrb_pq_clock_ns() : 0;
+  int ntuples = PQntuples(result);
+  int nfields = PQnfields(result);
+  mrb_pq_decoder decoders[nfields > 0 ? nfields : 1];
+  mrb_pq_resolve_decoders(mrb, self, result, nfields, decoders);
+  mrb_value null_value = mrb_symbol_value(mrb_intern_lit(mrb, "NULL"));
+  struct RClass *record_class = mrb_pq_record_class(mrb, self, result, nfields);
+  mrb_value records = mrb_ary_new_capa(mrb, ntuples);
 
-  Oid foo = PQftable((const PGresult *) DATA_PTR(self), (int) column_number);
-  if (foo == InvalidOid) {
-    mrb_raise(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "InvalidOid"), "Column number is out of range, or the specified column is not a simple reference to a table column, or using pre-3.0 protocol");
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (int row_number = 0; row_number < ntuples; row_number++) {
+    mrb_ary_push(mrb, records, mrb_pq_result_record(mrb, record_class, result, row_number, nfields, decoders, null_value));
+    mrb_gc_arena_restore(mrb, arena_index);
   }
 
-  return mrb_int_value(mrb, foo);
+  if (stats) {
+    stats->decode_ns += mrb_pq_clock_ns() - started;
+  }
+
+  return records;
+}
+
+static int
+mrb_pq_result_column_number(mrb_state *mrb, const PGresult *result, mrb_value column)
+{
+  int column_number;
+  if (mrb_integer_p(column)) {
+    mrb_int number = mrb_integer(column);
+    if (number < 0 || number >= PQnfields(result)) {
+      mrb_raisef(mrb, E_INDEX_ERROR, "column %i out of range", number);
+    }
+    column_number = (int) number;
+  } else {
+    column_number = PQfnumber(result, mrb_string_value_cstr(mrb, &column));
+    if (column_number == -1) {
+      mrb_raisef(mrb, E_INDEX_ERROR, "no such column %v", column);
+    }
+  }
+
+  return column_number;
 }
 
 static mrb_value
-mrb_PQftablecol(mrb_state *mrb, mrb_value self)
+mrb_pq_result_column_values(mrb_state *mrb, mrb_value self, const PGresult *result, int column_number, mrb_value null_value)
 {
-  mrb_int column_number;
-  mrb_get_args(mrb, "i", &column_number);
-  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
+  mrb_pq_query_stats *stats = mrb_pq_result_stats(mrb, self);
+  uint64_t started = stats ? mrb_pq_clock_ns() : 0;
+  int ntuples = PQntuples(result);
+  mrb_pq_decoder decoder = mrb_pq_decoder_for(mrb, self, result, column_number);
+  mrb_value values = mrb_ary_new_capa(mrb, ntuples);
 
-  int foo = PQftablecol((const PGresult *) DATA_PTR(self), (int) column_number);
-  if (foo == 0) {
-    mrb_raise(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "Error"), "Column number is out of range, or the specified column is not a simple reference to a table column, or using pre-3.0 protocol");
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (int row_number = 0; row_number < ntuples; row_number++) {
+    if (PQgetisnull(result, row_number, column_number)) {
+      mrb_ary_push(mrb, values, null_value);
+    } else {
+      mrb_ary_push(mrb, values, mrb_pq_decode(mrb, result, row_number, column_number, &decoder));
+    }
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+  if (stats) {
+    stats->decode_ns += mrb_pq_clock_ns() - started;
   }
 
-  return mrb_int_value(mrb, foo);
+  return values;
 }
 
 static mrb_value
-mrb_PQfformat(mrb_state *mrb, mrb_value self)
+mrb_pq_result_column(mrb_state *mrb, mrb_value self)
 {
-  mrb_int column_number;
-  mrb_get_args(mrb, "i", &column_number);
-  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
+  mrb_value column;
+  mrb_get_args(mrb, "o", &column);
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
 
-  return mrb_int_value(mrb, PQfformat((const PGresult *) DATA_PTR(self), (int) column_number));
+  return mrb_pq_result_column_values(mrb, self, result, mrb_pq_result_column_number(mrb, result, column), mrb_symbol_value(mrb_intern_lit(mrb, "NULL")));
 }
 
 static mrb_value
-mrb_PQftype(mrb_state *mrb, mrb_value self)
+mrb_pq_result_columns(mrb_state *mrb, mrb_value self)
 {
-  mrb_int column_number;
-  mrb_get_args(mrb, "i", &column_number);
-  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
+  int nfields = PQnfields(result);
+  mrb_value null_value = mrb_symbol_value(mrb_intern_lit(mrb, "NULL"));
+  mrb_value columns = mrb_ary_new_capa(mrb, nfields);
 
-  return mrb_int_value(mrb, PQftype((const PGresult *) DATA_PTR(self), (int) column_number));
+  int arena_index = mrb_gc_arena_save(mrb);
+  for (int column_number = 0; column_number < nfields; column_number++) {
+    mrb_ary_push(mrb, columns, mrb_pq_result_column_values(mrb, self, result, column_number, null_value));
+    mrb_gc_arena_restore(mrb, arena_index);
+  }
+
+  return columns;
 }
 
 static mrb_value
-mrb_pq_decode_text_value(mrb_state *mrb, const PGresult *result, int row_number, int column_number, char *value)
+mrb_pq_result_packed_column(mrb_state *mrb, mrb_value self)
 {
-  switch(PQftype(result, column_number)) {
-    case 16: { // bool
-      return mrb_bool_value(value[0] == 't');
-    } break;
-    case 20: { // int64_t
-      return mrb_int_value(mrb, strtoll(value, NULL, 0));
-    } break;
+  mrb_value column;
+  mrb_get_args(mrb, "o", &column);
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
+  int column_number = mrb_pq_result_column_number(mrb, result, column);
+  int ntuples = PQntuples(result);
+  int binary = PQfformat(result, column_number) == 1;
+  Oid type = PQftype(result, column_number);
+
+  switch(type) {
+    case 20: // int64_t
     case 23: // int32_t
     case 21: // int16_t
-      return mrb_int_value(mrb, strtol(value, NULL, 0));
-    break;
-    case 114:
-    case 3802: {
-      if (mrb_class_defined(mrb, "JSON")) {
-        return mrb_funcall(mrb, mrb_obj_value(mrb_module_get(mrb, "JSON")), "parse", 1, mrb_str_new(mrb, value, PQgetlength(result, row_number, column_number)));
-      } else {
-        goto def;
-      }
-    } break;
-    case 142: {
-      if (mrb_class_defined(mrb, "XML")) {
-        return mrb_funcall(mrb, mrb_obj_value(mrb_module_get(mrb, "XML")), "parse", 1, mrb_str_new(mrb, value, PQgetlength(result, row_number, column_number)));
-      } else {
-        goto def;
+    case 26: { // oid
+      mrb_value str = mrb_str_new(mrb, NULL, ntuples * sizeof(int64_t));
+      int64_t *dst = (int64_t *) RSTRING_PTR(str);
+      for (int row_number = 0; row_number < ntuples; row_number++) {
+        const char *value = PQgetvalue(result, row_number, column_number);
+        if (PQgetisnull(result, row_number, column_number)) {
+          dst[row_number] = 0;
+        } else if (!binary) {
+          dst[row_number] = strtoll(value, NULL, 10);
+        } else if (type == 20) {
+          dst[row_number] = (int64_t) mrb_pq_read_uint64(value);
+        } else if (type == 23) {
+          dst[row_number] = (int32_t) mrb_pq_read_uint32(value);
+        } else if (type == 21) {
+          dst[row_number] = (int16_t) mrb_pq_read_uint16(value);
+        } else {
+          dst[row_number] = mrb_pq_read_uint32(value);
+        }
       }
+      return str;
     } break;
-#ifndef MRB_WITHOUT_FLOAT
-    case 700: { // float
-      return mrb_float_value(mrb, strtof(value, NULL));
-    } break;
-#ifndef MRB_USE_FLOAT
+    case 700: // float
     case 701: { // double
-      return mrb_float_value(mrb, strtod(value, NULL));
-#endif
+      mrb_value str = mrb_str_new(mrb, NULL, ntuples * sizeof(double));
+      double *dst = (double *) RSTRING_PTR(str);
+      for (int row_number = 0; row_number < ntuples; row_number++) {
+        const char *value = PQgetvalue(result, row_number, column_number);
+        if (PQgetisnull(result, row_number, column_number)) {
+          dst[row_number] = NAN;
+        } else if (!binary) {
+          dst[row_number] = strtod(value, NULL);
+        } else if (type == 701) {
+          union {
+            double f;
+            uint64_t i;
+          } swap;
+          swap.i = mrb_pq_read_uint64(value);
+          dst[row_number] = swap.f;
+        } else {
+          union {
+            float f;
+            uint32_t i;
+          } swap;
+          swap.i = mrb_pq_read_uint32(value);
+          dst[row_number] = swap.f;
+        }
+      }
+      return str;
     } break;
-#endif
     default: {
-def:
-      return mrb_str_new(mrb, value, PQgetlength(result, row_number, column_number));
+      mrb_raisef(mrb, E_TYPE_ERROR, "column %d of type %d cannot be packed", column_number, (int) type);
     }
   }
-}
 
-static mrb_value
-mrb_PQgetvalue(mrb_state *mrb, mrb_value self)
-{
-  mrb_int row_number, column_number;
-  mrb_get_args(mrb, "ii", &row_number, &column_number);
-  mrb_assert_int_fit(mrb_int, row_number, int, INT_MAX);
-  mrb_assert_int_fit(mrb_int, column_number, int, INT_MAX);
-  const PGresult *result = (const PGresult *) DATA_PTR(self);
-
-  char *value = PQgetvalue(result, (int) row_number, (int) column_number);
-  if (value) {
-    if (PQgetisnull(result, (int) row_number, (int) column_number)) {
-      return mrb_symbol_value(mrb_intern_lit(mrb, "NULL"));
-    } else if (PQfformat(result, (int) column_number) == 0) {
-      return mrb_pq_decode_text_value(mrb, result, (int) row_number, (int) column_number, value);
-    } else {
-      return mrb_str_new(mrb, value, PQgetlength(result, (int) row_number, (int) column_number));
-    }
-  } else {
-    return mrb_nil_value();
-  }
+  return mrb_nil_value();
 }
 
 static mrb_value
@@ -635,6 +4699,19 @@ mrb_PQparamtype(mrb_state *mrb, mrb_value self)
   return mrb_int_value(mrb, PQparamtype((const PGresult *) DATA_PTR(self), (int) param_number));
 }
 
+static mrb_value
+mrb_pq_result_paramtypes(mrb_state *mrb, mrb_value self)
+{
+  const PGresult *result = (const PGresult *) DATA_PTR(self);
+  int nparams = PQnparams(result);
+  mrb_value paramtypes = mrb_ary_new_capa(mrb, nparams);
+  for (int param_number = 0; param_number < nparams; param_number++) {
+    mrb_ary_push(mrb, paramtypes, mrb_int_value(mrb, PQparamtype(result, param_number)));
+  }
+
+  return paramtypes;
+}
+
 static mrb_value
 mrb_PQresultErrorField(mrb_state *mrb, mrb_value self)
 {
@@ -653,26 +4730,112 @@ mrb_PQresultErrorField(mrb_state *mrb, mrb_value self)
 void
 mrb_mruby_postgresql_gem_init(mrb_state *mrb)
 {
-  struct RClass *pq_class, *pq_error_class, *pq_result_mixins, *pq_result_class, *pq_result_error_class, *pq_notice_processor_class;
+  struct RClass *pq_class, *pq_error_class, *pq_result_mixins, *pq_result_class, *pq_result_error_class, *pq_notice_processor_class, *pq_copy_in_class, *pq_type_registry_class, *pq_json_class;
   pq_class = mrb_define_class(mrb, "Pq", mrb->object_class);
   MRB_SET_INSTANCE_TT(pq_class, MRB_TT_DATA);
   pq_error_class = mrb_define_class_under(mrb, pq_class, "Error", E_RUNTIME_ERROR);
   mrb_define_class_under(mrb, pq_class, "ConnectionError", pq_error_class);
+  mrb_define_class_under(mrb, pq_class, "TimeoutError", pq_error_class);
+  mrb_define_const(mrb, pq_class, "TEXT", mrb_int_value(mrb, 0));
+  mrb_define_const(mrb, pq_class, "BINARY", mrb_int_value(mrb, 1));
+#ifdef LIBPQ_HAS_CHUNK_MODE
+  mrb_define_const(mrb, pq_class, "CHUNKED_ROWS", mrb_true_value());
+#else
+  mrb_define_const(mrb, pq_class, "CHUNKED_ROWS", mrb_false_value());
+#endif
+#ifdef MRB_PQ_STRING_VIEWS
+  mrb_define_const(mrb, pq_class, "STRING_VIEWS", mrb_true_value());
+#else
+  mrb_define_const(mrb, pq_class, "STRING_VIEWS", mrb_false_value());
+#endif
   mrb_define_method(mrb, pq_class, "initialize",  mrb_PQconnectdb, MRB_ARGS_OPT(1));
   mrb_define_method(mrb, pq_class, "finish",  mrb_PQfinish, MRB_ARGS_NONE());
   mrb_define_alias (mrb, pq_class, "close", "finish");
   mrb_define_method(mrb, pq_class, "exec",  mrb_PQexec, MRB_ARGS_REQ(1)|MRB_ARGS_REST()|MRB_ARGS_BLOCK());
   mrb_define_method(mrb, pq_class, "_prepare",  mrb_PQprepare, MRB_ARGS_REQ(2));
   mrb_define_method(mrb, pq_class, "exec_prepared",  mrb_PQexecPrepared, MRB_ARGS_REQ(1)|MRB_ARGS_REST()|MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, pq_class, "_exec_prepared_typed",  mrb_pq_exec_prepared_typed, MRB_ARGS_REQ(2)|MRB_ARGS_REST()|MRB_ARGS_BLOCK());
   mrb_define_method(mrb, pq_class, "describe_prepared",  mrb_PQdescribePrepared, MRB_ARGS_OPT(1));
   mrb_define_method(mrb, pq_class, "describe_portal",  mrb_PQdescribePortal, MRB_ARGS_OPT(1));
-  mrb_define_method(mrb, pq_class, "reset",  mrb_PQreset, MRB_ARGS_NONE());
-  mrb_define_method(mrb, pq_class, "cancel",  mrb_PQrequestCancel, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "send_query",  mrb_PQsendQuery, MRB_ARGS_REQ(1)|MRB_ARGS_REST());
+  mrb_define_method(mrb, pq_class, "send_prepare",  mrb_PQsendPrepare, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, pq_class, "send_prepared",  mrb_PQsendQueryPrepared, MRB_ARGS_REQ(1)|MRB_ARGS_REST());
+  mrb_define_method(mrb, pq_class, "get_result",  mrb_PQgetResult, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "consume_input",  mrb_PQconsumeInput, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "busy?",  mrb_PQisBusy, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "flush",  mrb_PQflush, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "nonblocking=",  mrb_PQsetnonblocking, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, pq_class, "nonblocking?",  mrb_PQisnonblocking, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "put_copy_data",  mrb_PQputCopyData, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, pq_class, "put_copy_end",  mrb_PQputCopyEnd, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, pq_class, "get_copy_data",  mrb_PQgetCopyData, MRB_ARGS_OPT(1));
+#ifdef LIBPQ_HAS_PIPELINING
+  mrb_define_const(mrb, pq_class, "PIPELINE_OFF", mrb_int_value(mrb, PQ_PIPELINE_OFF));
+  mrb_define_const(mrb, pq_class, "PIPELINE_ON", mrb_int_value(mrb, PQ_PIPELINE_ON));
+  mrb_define_const(mrb, pq_class, "PIPELINE_ABORTED", mrb_int_value(mrb, PQ_PIPELINE_ABORTED));
+  mrb_define_method(mrb, pq_class, "enter_pipeline_mode",  mrb_PQenterPipelineMode, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "exit_pipeline_mode",  mrb_PQexitPipelineMode, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "pipeline_sync",  mrb_PQpipelineSync, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "send_flush_request",  mrb_PQsendFlushRequest, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "pipeline_status",  mrb_PQpipelineStatus, MRB_ARGS_NONE());
+#endif
+  mrb_define_method(mrb, pq_class, "_reset",  mrb_PQreset, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "_reset_start",  mrb_PQresetStart, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "connect_poll",  mrb_pq_connect_poll, MRB_ARGS_NONE());
+  mrb_define_alias (mrb, pq_class, "reset_poll", "connect_poll");
+  mrb_define_class_method(mrb, pq_class, "connect_start",  mrb_PQconnectStart, MRB_ARGS_OPT(1));
+  mrb_define_class_method(mrb, pq_class, "_poll",  mrb_pq_poll, MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, pq_class, "reload_types",  mrb_pq_reload_types, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "cancel",  mrb_pq_request_cancel, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "notifies",  mrb_PQnotifies, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "_trace",  mrb_PQtrace, MRB_ARGS_ARG(1, 1));
+  mrb_define_method(mrb, pq_class, "untrace",  mrb_PQuntrace, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "trace_messages",  mrb_pq_trace_messages, MRB_ARGS_OPT(1));
+#ifdef LIBPQ_HAS_TRACE_FLAGS
+  mrb_define_method(mrb, pq_class, "trace_flags=",  mrb_PQsetTraceFlags, MRB_ARGS_REQ(1));
+  mrb_define_const(mrb, pq_class, "TRACE_SUPPRESS_TIMESTAMPS", mrb_int_value(mrb, PQTRACE_SUPPRESS_TIMESTAMPS));
+  mrb_define_const(mrb, pq_class, "TRACE_REGRESS_MODE", mrb_int_value(mrb, PQTRACE_REGRESS_MODE));
+#endif
+  mrb_define_method(mrb, pq_class, "_wait_for_notify",  mrb_pq_wait_for_notify, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, pq_class, "closed?",  mrb_pq_closed, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "status",  mrb_PQstatus, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_class, "transaction_status",  mrb_PQtransactionStatus, MRB_ARGS_NONE());
+  mrb_define_const(mrb, pq_class, "CONNECTION_OK", mrb_int_value(mrb, CONNECTION_OK));
+  mrb_define_const(mrb, pq_class, "CONNECTION_BAD", mrb_int_value(mrb, CONNECTION_BAD));
+  mrb_define_const(mrb, pq_class, "TRANS_IDLE", mrb_int_value(mrb, PQTRANS_IDLE));
+  mrb_define_const(mrb, pq_class, "TRANS_ACTIVE", mrb_int_value(mrb, PQTRANS_ACTIVE));
+  mrb_define_const(mrb, pq_class, "TRANS_INTRANS", mrb_int_value(mrb, PQTRANS_INTRANS));
+  mrb_define_const(mrb, pq_class, "TRANS_INERROR", mrb_int_value(mrb, PQTRANS_INERROR));
+  mrb_define_const(mrb, pq_class, "TRANS_UNKNOWN", mrb_int_value(mrb, PQTRANS_UNKNOWN));
   mrb_define_method(mrb, pq_class, "socket",  mrb_PQsocket, MRB_ARGS_NONE());
   mrb_define_alias (mrb, pq_class, "to_i", "socket");
   mrb_define_method(mrb, pq_class, "notice_receiver",  mrb_PQsetNoticeReceiver, MRB_ARGS_BLOCK());
   pq_notice_processor_class = mrb_define_class_under(mrb, pq_class, "NoticeReceiver", mrb->object_class);
   MRB_SET_INSTANCE_TT(pq_notice_processor_class, MRB_TT_DATA);
+  pq_copy_in_class = mrb_define_class_under(mrb, pq_class, "CopyIn", mrb->object_class);
+  mrb_define_class_method(mrb, pq_copy_in_class, "encode_row", mrb_pq_copy_encode_row, MRB_ARGS_ARG(1, 1));
+  mrb_define_const(mrb, pq_copy_in_class, "BINARY_HEADER", mrb_str_new_lit(mrb, "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0"));
+  mrb_define_const(mrb, pq_copy_in_class, "BINARY_TRAILER", mrb_str_new_lit(mrb, "\377\377"));
+  pq_type_registry_class = mrb_define_class_under(mrb, pq_class, "TypeRegistry", mrb->object_class);
+  MRB_SET_INSTANCE_TT(pq_type_registry_class, MRB_TT_DATA);
+  mrb_undef_class_method(mrb, pq_type_registry_class, "new");
+  mrb_define_method(mrb, pq_type_registry_class, "_register", mrb_pq_type_registry_register, MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, pq_type_registry_class, "loaded?", mrb_pq_type_registry_loaded, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_type_registry_class, "json_mode", mrb_pq_type_registry_json_mode, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_type_registry_class, "json_mode=", mrb_pq_type_registry_set_json_mode, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, pq_type_registry_class, "string_views", mrb_pq_type_registry_string_views, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_type_registry_class, "string_views=", mrb_pq_type_registry_set_string_views, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, pq_type_registry_class, "time_mode", mrb_pq_type_registry_time_mode, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_type_registry_class, "time_mode=", mrb_pq_type_registry_set_time_mode, MRB_ARGS_REQ(1));
+  struct RClass *pq_record_class = mrb_define_class_under(mrb, pq_class, "Record", mrb->array_class);
+  mrb_define_method(mrb, pq_record_class, "[]", mrb_pq_record_aref, MRB_ARGS_ANY());
+  struct RClass *pq_query_stats_class = mrb_define_class_under(mrb, pq_class, "QueryStats", mrb->object_class);
+  MRB_SET_INSTANCE_TT(pq_query_stats_class, MRB_TT_DATA);
+  mrb_undef_class_method(mrb, pq_query_stats_class, "new");
+  mrb_define_method(mrb, pq_query_stats_class, "to_h", mrb_pq_query_stats_to_h, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_query_stats_class, "histogram", mrb_pq_query_stats_histogram, MRB_ARGS_NONE());
+  pq_json_class = mrb_define_class_under(mrb, pq_class, "JSON", mrb->object_class);
+  mrb_define_method(mrb, pq_json_class, "dig", mrb_pq_json_dig, MRB_ARGS_REQ(1)|MRB_ARGS_REST());
   pq_result_mixins = mrb_define_module_under(mrb, pq_class, "ResultMixins");
   mrb_define_const(mrb, pq_result_mixins, "EMPTY_QUERY", mrb_int_value(mrb, PGRES_EMPTY_QUERY));
   mrb_define_const(mrb, pq_result_mixins, "COMMAND_OK", mrb_int_value(mrb, PGRES_COMMAND_OK));
@@ -684,6 +4847,13 @@ mrb_mruby_postgresql_gem_init(mrb_state *mrb)
   mrb_define_const(mrb, pq_result_mixins, "FATAL_ERROR", mrb_int_value(mrb, PGRES_FATAL_ERROR));
   mrb_define_const(mrb, pq_result_mixins, "COPY_BOTH", mrb_int_value(mrb, PGRES_COPY_BOTH));
   mrb_define_const(mrb, pq_result_mixins, "SINGLE_TUPLE", mrb_int_value(mrb, PGRES_SINGLE_TUPLE));
+#ifdef LIBPQ_HAS_CHUNK_MODE
+  mrb_define_const(mrb, pq_result_mixins, "TUPLES_CHUNK", mrb_int_value(mrb, PGRES_TUPLES_CHUNK));
+#endif
+#ifdef LIBPQ_HAS_PIPELINING
+  mrb_define_const(mrb, pq_result_mixins, "PIPELINE_SYNC", mrb_int_value(mrb, PGRES_PIPELINE_SYNC));
+  mrb_define_const(mrb, pq_result_mixins, "PIPELINE_ABORTED", mrb_int_value(mrb, PGRES_PIPELINE_ABORTED));
+#endif
   mrb_define_method(mrb, pq_result_mixins, "ntuples", mrb_PQntuples, MRB_ARGS_NONE());
   mrb_define_method(mrb, pq_result_mixins, "nfields", mrb_PQnfields, MRB_ARGS_NONE());
   mrb_define_method(mrb, pq_result_mixins, "fname", mrb_PQfname, MRB_ARGS_REQ(1));
@@ -695,10 +4865,23 @@ mrb_mruby_postgresql_gem_init(mrb_state *mrb)
   mrb_define_method(mrb, pq_result_mixins, "getisnull", mrb_PQgetisnull, MRB_ARGS_REQ(2));
   mrb_define_method(mrb, pq_result_mixins, "nparams", mrb_PQnparams, MRB_ARGS_NONE());
   mrb_define_method(mrb, pq_result_mixins, "paramtype", mrb_PQparamtype, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, pq_result_mixins, "paramtypes", mrb_pq_result_paramtypes, MRB_ARGS_NONE());
   mrb_define_method(mrb, pq_result_mixins, "ftype", mrb_PQftype, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, pq_result_mixins, "binary_tuples?", mrb_PQbinaryTuples, MRB_ARGS_NONE());
   pq_result_class = mrb_define_class_under(mrb, pq_class, "Result", mrb->object_class);
   MRB_SET_INSTANCE_TT(pq_result_class, MRB_TT_DATA);
   mrb_include_module(mrb, pq_result_class, pq_result_mixins);
+  mrb_define_method(mrb, pq_result_class, "values", mrb_pq_result_values, MRB_ARGS_NONE());
+  mrb_define_alias (mrb, pq_result_class, "to_ary", "values");
+  mrb_define_method(mrb, pq_result_class, "names", mrb_pq_result_names, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_result_class, "each_row", mrb_pq_result_each_row, MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, pq_result_class, "each_hash", mrb_pq_result_each_hash, MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, pq_result_class, "map_rows", mrb_pq_result_map_rows, MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, pq_result_class, "each_record", mrb_pq_result_each_record, MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, pq_result_class, "to_records", mrb_pq_result_to_records, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_result_class, "column", mrb_pq_result_column, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, pq_result_class, "columns", mrb_pq_result_columns, MRB_ARGS_NONE());
+  mrb_define_method(mrb, pq_result_class, "packed_column", mrb_pq_result_packed_column, MRB_ARGS_REQ(1));
   pq_result_error_class = mrb_define_class_under(mrb, pq_result_class, "Error", pq_error_class);
   MRB_SET_INSTANCE_TT(pq_result_error_class, MRB_TT_DATA);
   mrb_include_module(mrb, pq_result_error_class, pq_result_mixins);
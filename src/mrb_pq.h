@@ -1,8 +1,14 @@
+// fopencookie
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <libpq-fe.h>
+#include <libpq-events.h>
 #include <mruby.h>
 #include <mruby/data.h>
 #include <mruby/value.h>
 #include <mruby/array.h>
+#include <mruby/hash.h>
 #include <mruby/string.h>
 #include <mruby/class.h>
 #include <mruby/error.h>
@@ -10,11 +16,31 @@
 #include <mruby/throw.h>
 #include <mruby/dump.h>
 #include <mruby/numeric.h>
+#include <mruby/proc.h>
+#include <mruby/time.h>
+#include <mruby/version.h>
 #include <string.h>
+#include <strings.h>
+#include <stdio.h>
 #include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
 #include <stdlib.h>
+#include <math.h>
 #include <stdint.h>
 #include <inttypes.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// string views point a String into the PGresult the way mruby points substrings into their original, which needs the RString layout of mruby 2 and 3
+#if defined(RSTR_SET_FSHARED_FLAG) && MRUBY_RELEASE_MAJOR >= 2 && MRUBY_RELEASE_MAJOR <= 3
+#define MRB_PQ_STRING_VIEWS
+#endif
 
 #ifndef E_IO_ERROR
 #define E_IO_ERROR (mrb_exc_get(mrb, "IOError"))
@@ -65,62 +91,360 @@ mrb_pq_handle_connection_error(mrb_state *mrb, mrb_value self, const PGconn *con
   mrb_raise(mrb, mrb_class_get_under(mrb, mrb_obj_class(mrb, self), "ConnectionError"), PQerrorMessage(conn));
 }
 
+enum mrb_pq_json_mode {
+  MRB_PQ_JSON_LAZY,
+  MRB_PQ_JSON_PARSE,
+  MRB_PQ_JSON_RAW
+};
+
+typedef struct {
+  Oid oid; // 0 marks a free slot
+  Oid element; // typelem of array types
+  Oid base; // typbasetype of domains
+  Oid decode_as; // decoded by the native decoder of this type instead
+  mrb_bool proc; // a ruby decoder is registered for this type
+  // resolved by mrb_pq_type_registry_compile
+  Oid target; // the type whose native decoder is used
+  Oid proc_type; // the type whose ruby decoder is used, 0 for none
+} mrb_pq_type;
+
+// open addressing table indexed by oid, so the decoder of a column is found with a single probe most of the time
+typedef struct {
+  mrb_pq_type *slots;
+  uint32_t mask;
+  uint32_t size;
+  int json_mode;
+  int string_views; // the minimum length of values returned as views into the PGresult, 0 disables them
+  mrb_bool epoch_usec; // dates and timestamps become Integers of microseconds since 1970 instead of Time objects
+  mrb_bool loaded; // pg_type was read, until then only the builtin types are known
+} mrb_pq_type_registry;
+
+static void
+mrb_pq_type_registry_free(mrb_state *mrb, void *p)
+{
+  mrb_pq_type_registry *registry = (mrb_pq_type_registry *) p;
+  if (registry) {
+    mrb_free(mrb, registry->slots);
+    mrb_free(mrb, registry);
+  }
+}
+
+static const struct mrb_data_type mrb_pq_type_registry_type = {
+  "$i_mrb_pq_type_registry", mrb_pq_type_registry_free
+};
+
+static inline mrb_value
+mrb_pq_types(mrb_state *mrb, mrb_value self)
+{
+  return mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@types"));
+}
+
+// log-linear buckets of microseconds, 8 per power of two so each is at most 12.5% wide, the last one catches everything above 2^40
+#define MRB_PQ_LATENCY_BUCKETS 312
+
+// counters of one statement name or normalized query of a connection, times are in nanoseconds
+typedef struct {
+  uint64_t calls;
+  uint64_t rows;
+  uint64_t bytes;
+  uint64_t wait_ns;
+  uint64_t encode_ns;
+  uint64_t decode_ns;
+  uint64_t max_latency_us;
+  uint32_t latency[MRB_PQ_LATENCY_BUCKETS];
+} mrb_pq_query_stats;
+
+static const struct mrb_data_type mrb_pq_query_stats_type = {
+  "$i_mrb_pq_query_stats", mrb_free
+};
+
+static inline uint64_t
+mrb_pq_clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+typedef struct mrb_pq_decoder mrb_pq_decoder;
+// value is NUL terminated for the text format
+typedef mrb_value (*mrb_pq_decode_func)(mrb_state *mrb, const char *value, int length, const mrb_pq_decoder *decoder);
+
+struct mrb_pq_decoder {
+  mrb_pq_decode_func func;
+  mrb_pq_decode_func element; // the decoder of the elements of array columns
+  mrb_value data; // the ruby decoder for mrb_pq_decode_with_proc, the Pq::JSON class for lazy json or the owner of string views
+  int string_views; // the minimum length for mrb_pq_decode_string_view
+  mrb_bool epoch_usec;
+};
+
+static int
+mrb_pq_result_format(mrb_state *mrb, mrb_value self)
+{
+  mrb_value result_format = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@result_format"));
+  return mrb_integer_p(result_format) ? (int) mrb_integer(result_format) : 0;
+}
+
+#ifdef LIBPQ_HAS_CHUNK_MODE
+static int
+mrb_pq_chunk_size(mrb_state *mrb, mrb_value self)
+{
+  mrb_value chunk_size = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "@chunk_size"));
+  return mrb_integer_p(chunk_size) ? (int) mrb_integer(chunk_size) : 1;
+}
+#endif
+
+static inline uint16_t
+mrb_pq_read_uint16(const char *value)
+{
+  const uint8_t *src = (const uint8_t *) value;
+  return (uint16_t) ((src[0] << 8) | src[1]);
+}
+
+static inline uint32_t
+mrb_pq_read_uint32(const char *value)
+{
+  const uint8_t *src = (const uint8_t *) value;
+  return ((uint32_t) src[0] << 24) | ((uint32_t) src[1] << 16) | ((uint32_t) src[2] << 8) | (uint32_t) src[3];
+}
+
+static inline uint64_t
+mrb_pq_read_uint64(const char *value)
+{
+  return ((uint64_t) mrb_pq_read_uint32(value) << 32) | (uint64_t) mrb_pq_read_uint32(value + 4);
+}
+
+static inline void
+mrb_pq_write_uint16(char *dst, uint16_t value)
+{
+  dst[0] = (char) (value >> 8);
+  dst[1] = (char) value;
+}
+
+static inline void
+mrb_pq_write_uint32(char *dst, uint32_t value)
+{
+  dst[0] = (char) (value >> 24);
+  dst[1] = (char) (value >> 16);
+  dst[2] = (char) (value >> 8);
+  dst[3] = (char) value;
+}
+
+static inline void
+mrb_pq_write_uint64(char *dst, uint64_t value)
+{
+  mrb_pq_write_uint32(dst, (uint32_t) (value >> 32));
+  mrb_pq_write_uint32(dst + 4, (uint32_t) value);
+}
+
+// seconds between 1970-01-01 and 2000-01-01, the epoch of the binary date/time formats
+#define MRB_PQ_POSTGRES_EPOCH 946684800
+
+static mrb_value
+mrb_pq_time_from_usec(mrb_state *mrb, int64_t usec, mrb_bool utc)
+{
+  int64_t sec = usec / 1000000;
+  usec %= 1000000;
+  if (usec < 0) {
+    sec--;
+    usec += 1000000;
+  }
+
+  return mrb_time_at(mrb, (time_t) sec, (time_t) usec, utc ? MRB_TIMEZONE_UTC : MRB_TIMEZONE_LOCAL);
+}
+
+// per parameter space for its binary or text representation, large enough for "%.17g" of a double
+#define MRB_PQ_SCRATCH_SIZE 32
+
 static const char *
-mrb_pq_encode_integer(mrb_state *mrb, mrb_value value, Oid *paramType, int *paramLength)
+mrb_pq_encode_integer(mrb_state *mrb, mrb_value value, Oid declaredType, char *scratch, Oid *paramType, int *paramLength, int *paramFormat)
 {
   mrb_int number = mrb_integer(value);
-  mrb_value str = mrb_str_new(mrb, NULL, sizeof(number));
+  *paramFormat = 1;
 
+  switch (declaredType) {
+    case 21: { // int16_t
+      if (unlikely(number < INT16_MIN || number > INT16_MAX)) {
+        mrb_raisef(mrb, E_RANGE_ERROR, "%i out of range for int2", number);
+      }
+      mrb_pq_write_uint16(scratch, (uint16_t) number);
+      *paramType = 21;
+      *paramLength = 2;
+    } break;
+    case 23: { // int32_t
+#if (MRB_INT_BIT > 32)
+      if (unlikely(number < INT32_MIN || number > INT32_MAX)) {
+        mrb_raisef(mrb, E_RANGE_ERROR, "%i out of range for int4", number);
+      }
+#endif
+      mrb_pq_write_uint32(scratch, (uint32_t) number);
+      *paramType = 23;
+      *paramLength = 4;
+    } break;
+    case 20: { // int64_t
+      mrb_pq_write_uint64(scratch, (uint64_t) number);
+      *paramType = 20;
+      *paramLength = 8;
+    } break;
+    case 26: { // oid
+      if (unlikely(number < 0 || (uint64_t) number > UINT32_MAX)) {
+        mrb_raisef(mrb, E_RANGE_ERROR, "%i out of range for oid", number);
+      }
+      mrb_pq_write_uint32(scratch, (uint32_t) number);
+      *paramType = 26;
+      *paramLength = 4;
+    } break;
+    case 700: { // float
+      union {
+        float f;
+        uint32_t i;
+      } swap;
+      swap.f = (float) number;
+      mrb_pq_write_uint32(scratch, swap.i);
+      *paramType = 700;
+      *paramLength = 4;
+    } break;
+    case 701: { // double
+      union {
+        double f;
+        uint64_t i;
+      } swap;
+      swap.f = (double) number;
+      mrb_pq_write_uint64(scratch, swap.i);
+      *paramType = 701;
+      *paramLength = 8;
+    } break;
+    case 16: { // bool
+      mrb_raise(mrb, E_TYPE_ERROR, "cannot send Integer as bool");
+    } break;
+    case 0: { // no declared type
 #if (MRB_INT_BIT == 64)
-  *paramType = 20;
+      *paramType = 20;
 #elif (MRB_INT_BIT == 32)
-  *paramType = 23;
+      *paramType = 23;
 #elif (MRB_INT_BIT == 16)
-  *paramType = 21;
+      *paramType = 21;
 #else
 #error "mruby-postgresql: unknown MRB_INT_BIT found in <mruby/value.h>"
 #endif
-  *paramLength = sizeof(number);
-
-  uint8_t *dst = (uint8_t *) RSTRING_PTR(str);
-  for (int i = sizeof(number) - 1;i > 0; i--) {
-    dst[i] = (uint8_t) number;
-    number >>= 8;
+      *paramLength = sizeof(number);
+      uint8_t *dst = (uint8_t *) scratch;
+      for (int i = sizeof(number) - 1;i > 0; i--) {
+        dst[i] = (uint8_t) number;
+        number >>= 8;
+      }
+      dst[0] = (uint8_t) number;
+    } break;
+    default: { // numeric, text and everything else is left to the input function of the declared type
+      *paramType = declaredType;
+      *paramLength = snprintf(scratch, MRB_PQ_SCRATCH_SIZE, "%" PRId64, (int64_t) number);
+      *paramFormat = 0;
+    }
   }
-  dst[0] = (uint8_t) number;
 
-  return RSTRING_PTR(str);
+  return scratch;
 }
 
 #ifndef MRB_WITHOUT_FLOAT
-#if (defined(MRB_USE_FLOAT) && MRB_INT_BIT != 32)||(MRB_INT_BIT != 64)
-#error "mruby-postgresql: size of mrb_float and mrb_int differ, cannot pack floats. (define MRB_INT64 when MRB_USE_FLOAT isn't defined, MRB_INT32 when MRB_USE_FLOAT is defined <mrbconf.h>)"
-#endif
 static const char *
-mrb_pq_encode_float(mrb_state *mrb, mrb_value value, Oid *paramType, int *paramLength)
+mrb_pq_encode_float(mrb_state *mrb, mrb_value value, Oid declaredType, char *scratch, Oid *paramType, int *paramLength, int *paramFormat)
 {
-  union {
-    mrb_float f;
-    mrb_int i;
-  } swap;
-
-  swap.f = mrb_float(value);
-  mrb_value str = mrb_str_new(mrb, NULL, sizeof(swap));
+  mrb_float number = mrb_float(value);
+  *paramFormat = 1;
 
+  if (declaredType == 0) {
 #ifdef MRB_USE_FLOAT
-  *paramType = 700;
+    declaredType = 700;
 #else
-  *paramType = 701;
+    declaredType = 701;
 #endif
-  *paramLength = sizeof(swap);
+  }
 
-  uint8_t *dst = (uint8_t *) RSTRING_PTR(str);
-  for (int i = sizeof(swap) - 1;i > 0; i--) {
-    dst[i] = (uint8_t) swap.i;
-    swap.i >>= 8;
+  switch (declaredType) {
+    case 700: { // float
+      union {
+        float f;
+        uint32_t i;
+      } swap;
+      swap.f = (float) number;
+      mrb_pq_write_uint32(scratch, swap.i);
+      *paramType = 700;
+      *paramLength = 4;
+    } break;
+    case 701: { // double
+      union {
+        double f;
+        uint64_t i;
+      } swap;
+      swap.f = (double) number;
+      mrb_pq_write_uint64(scratch, swap.i);
+      *paramType = 701;
+      *paramLength = 8;
+    } break;
+    case 16: { // bool
+      mrb_raise(mrb, E_TYPE_ERROR, "cannot send Float as bool");
+    } break;
+    case 20: // int64_t
+    case 21: // int16_t
+    case 23: // int32_t
+    case 26: { // oid
+      mrb_raise(mrb, E_TYPE_ERROR, "cannot send Float as an integer");
+    } break;
+    default: { // numeric, text and everything else is left to the input function of the declared type
+      *paramType = declaredType;
+      *paramLength = snprintf(scratch, MRB_PQ_SCRATCH_SIZE, "%.17g", (double) number);
+      *paramFormat = 0;
+    }
   }
-  dst[0] = (uint8_t) swap.i;
 
-  return RSTRING_PTR(str);
+  return scratch;
 }
 #endif
+
+static inline mrb_bool
+mrb_pq_time_p(mrb_state *mrb, mrb_value value)
+{
+  return mrb_data_p(value) && mrb_obj_is_kind_of(mrb, value, mrb_class_get(mrb, "Time"));
+}
+
+// Time parameters are sent as binary timestamptz unless a date or timestamp is expected, timestamps get the UTC wall clock, all other declared types the ISO 8601 text in UTC
+static const char *
+mrb_pq_encode_time(mrb_state *mrb, mrb_value value, Oid declaredType, char *scratch, Oid *paramType, int *paramLength, int *paramFormat)
+{
+  int64_t sec = (int64_t) mrb_as_int(mrb, mrb_funcall(mrb, value, "to_i", 0));
+  int64_t usec = (int64_t) mrb_as_int(mrb, mrb_funcall(mrb, value, "usec", 0));
+  int64_t pg_usec = usec + (sec - MRB_PQ_POSTGRES_EPOCH) * 1000000;
+  *paramFormat = 1;
+
+  switch (declaredType) {
+    case 1082: { // date
+      int64_t days = pg_usec / (86400 * INT64_C(1000000));
+      if (pg_usec % (86400 * INT64_C(1000000)) < 0) {
+        days--;
+      }
+      mrb_pq_write_uint32(scratch, (uint32_t) (int32_t) days);
+      *paramType = 1082;
+      *paramLength = 4;
+    } break;
+    case 0: // no declared type
+    case 1114: // timestamp
+    case 1184: { // timestamptz
+      mrb_pq_write_uint64(scratch, (uint64_t) pg_usec);
+      *paramType = declaredType == 1114 ? 1114 : 1184;
+      *paramLength = 8;
+    } break;
+    default: { // text and everything else is left to the input function of the declared type
+      time_t time = (time_t) sec;
+      struct tm tm;
+      if (unlikely(!gmtime_r(&time, &tm) || tm.tm_year < 1 - 1900 || tm.tm_year > 9999 - 1900)) {
+        mrb_raise(mrb, E_RANGE_ERROR, "time out of range for the ISO 8601 text format");
+      }
+      *paramType = declaredType;
+      *paramLength = snprintf(scratch, MRB_PQ_SCRATCH_SIZE, "%04d-%02d-%02d %02d:%02d:%02d.%06d+00",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, (int) usec);
+      *paramFormat = 0;
+    }
+  }
+
+  return scratch;
+}
@@ -3,3 +3,604 @@ assert("ConnectDisconnect") do
     conn.close
     assert_raise(IOError) { conn.exec("select * from pg_database") }
 end
+
+assert("Pipeline") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  results = conn.pipeline do |p|
+    one = p.exec("select $1::int", 1)
+    p.exec("i am a syn;tax error")
+    p.exec("select 2")
+    assert_equal [[1]], one.value.to_ary
+    p.exec("select 3")
+  end
+  assert_equal 4, results.size
+  assert_kind_of Pq::Result::FatalError, results[1]
+  assert_kind_of Pq::Result::PipelineAbortedError, results[2]
+  assert_equal [[3]], results[3].to_ary
+  conn.close
+end
+
+assert("AsyncQuery") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.nonblocking = true
+  assert_true conn.nonblocking?
+  conn.send_query("select $1::int4 from pg_sleep(0.1)", 1)
+  nil until conn.flush
+  busy = 0
+  busy += 1 while conn.consume_input.busy?
+  assert_true busy > 0
+  assert_equal [[1]], conn.get_result.to_ary
+  assert_nil conn.get_result
+  conn.nonblocking = false
+  assert_false conn.nonblocking?
+  conn.close
+end
+
+assert("BinaryResults") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.with_result_format(Pq::BINARY) do
+    res = conn.exec("select true, 2::int2, 4::int4, 8::int8, 1.5::float8, -12345.0060::numeric, 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'::uuid")
+    assert_equal [[true, 2, 4, 8, 1.5, "-12345.0060", "a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11"]], res.to_ary
+    assert_equal 1, res.fformat(0)
+  end
+  assert_equal Pq::TEXT, conn.result_format
+  conn.close
+end
+
+assert("ReadingRows") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  res = conn.exec("select * from (values (1, 'a', 1.5::float8), (2, null, null), (null, 'c', 3.5)) t(id, name, price) order by id nulls last")
+  rows = [[1, "a", 1.5], [2, :NULL, :NULL], [:NULL, "c", 3.5]]
+  assert_equal rows, res.values
+  assert_equal ["id", "name", "price"], res.names
+  each_row = []
+  assert_equal res, res.each_row { |row| each_row << row }
+  assert_equal rows, each_row
+  each_hash = []
+  res.each_hash { |row| each_hash << row }
+  assert_equal [{"id" => 1, "name" => "a", "price" => 1.5}, {"id" => 2, "name" => :NULL, "price" => :NULL}, {"id" => :NULL, "name" => "c", "price" => 3.5}], each_hash
+  assert_equal ["a", :NULL, "c"], res.map_rows { |row| row[1] }
+  assert_raise(ArgumentError) { res.map_rows }
+  conn.close
+end
+
+assert("ReadingColumns") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  res = conn.exec("select * from (values (1::int4, 1.5::float8, 'a'), (null, null, null), (3, 3.5, 'c')) t(id, price, name)")
+  assert_equal [1.5, :NULL, 3.5], res.column("price")
+  assert_equal res.column("price"), res.column(1)
+  assert_equal [[1, :NULL, 3], [1.5, :NULL, 3.5], ["a", :NULL, "c"]], res.columns
+  assert_raise(IndexError) { res.column(3) }
+  assert_raise(IndexError) { res.column(-1) }
+  assert_raise(IndexError) { res.column("missing") }
+  assert_equal [1, 0, 3], res.packed_column("id").unpack("q*")
+  prices = res.packed_column(1).unpack("d*")
+  assert_equal 1.5, prices[0]
+  assert_true prices[1].nan?
+  assert_equal 3.5, prices[2]
+  assert_raise(IndexError) { res.packed_column(3) }
+  conn.close
+end
+
+assert("StreamInChunks") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  assert_equal 1, conn.chunk_size
+  assert_raise(ArgumentError) { conn.chunk_size = 0 }
+  conn.chunk_size = 10
+  assert_equal 10, conn.chunk_size
+  sizes = []
+  conn.exec("select g from generate_series(1, 95) g") { |res| sizes << res.ntuples }
+  assert_equal 95, sizes.inject(:+)
+  assert_equal Pq::CHUNKED_ROWS ? 10 : 1, sizes.max
+  rows = []
+  conn.stream("select g from generate_series(1, $1::int4) g", 95) { |row| rows << row[0] }
+  assert_equal (1..95).to_a, rows
+  conn.close
+end
+
+assert("Copy") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.exec("create temporary table copy_test (id int8, name text, flag bool)")
+  conn.copy_in("copy copy_test from stdin with (format binary)") do |io|
+    io.put_row(1, "foo", true)
+    io.put_row(2, nil, false)
+  end
+  conn.copy_in("copy copy_test from stdin") do |io|
+    io.put("3\tbar\tt\n")
+  end
+  assert_equal [[1, "foo", true], [2, :NULL, false], [3, "bar", true]], conn.exec("select * from copy_test order by id").to_ary
+  data = ""
+  conn.copy_out("copy (select id from copy_test order by id) to stdout") { |chunk| data << chunk }
+  assert_equal "1\n2\n3\n", data
+  rows = 0
+  conn.copy_out("copy (select generate_series(1, 1000000)) to stdout") { |chunk| break if (rows += 1) == 2 }
+  assert_equal 2, rows
+  assert_equal [[1]], conn.exec("select 1").to_ary
+  assert_raise(RuntimeError) do
+    conn.copy_out("copy (select generate_series(1, 1000000)) to stdout") { |chunk| raise "stop" }
+  end
+  assert_equal [[1]], conn.exec("select 1").to_ary
+  conn.close
+end
+
+assert("Pool") do
+  pool = Pq::Pool.new("postgresql://localhost/postgres", max: 1)
+  conn = pool.with do |c|
+    c.exec("begin")
+    assert_raise(Pq::Pool::ExhaustedError) { pool.checkout }
+    c
+  end
+  assert_equal Pq::TRANS_IDLE, conn.transaction_status
+  assert_same conn, pool.checkout
+  pool.close
+end
+
+assert("StatementCache") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.statement_cache = 1
+  assert_equal [[1]], conn.exec("select $1::int", 1).to_ary
+  assert_equal [[2]], conn.exec("select $1::int", 2).to_ary
+  assert_equal 1, conn.statement_cache.size
+  assert_equal [["a"]], conn.exec("select $1::text", "a").to_ary
+  assert_equal [[1]], conn.exec("select count(*)::int from pg_prepared_statements").to_ary
+  conn.reset
+  assert_equal 0, conn.statement_cache.size
+  conn.close
+end
+
+assert("ArrayParams") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  assert_equal [[3]], conn.exec("select count(*)::int from generate_series(1, 10) as g where g = any($1)", [2, 4, 20, 8]).to_ary
+  assert_equal [["b"]], conn.exec("select ($1::text[])[2]", ["a", "b", nil]).to_ary
+  stmt = conn.prepare("array_param", "select array_length($1::int4[], 1)")
+  assert_equal [[2]], stmt.exec([1, 2]).to_ary
+  assert_raise(TypeError) { conn.exec("select $1", [1, "a"]) }
+  conn.close
+end
+
+assert("ArraysAndRecords") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  assert_equal [[[[1, 2], [3, :NULL]], ["a b", "c\"d"]]], conn.exec("select array[[1,2],[3,null]], array['a b', 'c\"d']").to_ary
+  assert_equal [[["1", "a b", :NULL]]], conn.exec("select row(1, 'a b', null)").to_ary
+  conn.with_result_format(Pq::BINARY) do
+    assert_equal [[[[1, 2], [3, :NULL]], ["a b", "c\"d"]]], conn.exec("select array[[1,2],[3,null]], array['a b', 'c\"d']").to_ary
+    assert_equal [[[1, "a b", :NULL]]], conn.exec("select row(1, 'a b'::text, null::int)").to_ary
+  end
+  conn.close
+end
+
+assert("TypeRegistry") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.exec("create domain pg_temp.positive_int as int4 check (value > 0)")
+  conn.reload_types
+  assert_equal [[5, [1, 2]]], conn.exec("select 5::pg_temp.positive_int, array[1, 2]::pg_temp.positive_int[]").to_ary
+  conn.types.register_decoder("int4") { |value| "int4 #{value}" }
+  assert_equal [["int4 5", ["int4 1"]]], conn.exec("select 5::int4, array[1]::int4[]").to_ary
+  assert_equal [["int4 5"]], conn.exec("select 5::pg_temp.positive_int").to_ary
+  conn.types.unregister("int4")
+  assert_equal [[5]], conn.exec("select 5::int4").to_ary
+  conn.types.decode_as("varchar", "int4")
+  assert_equal [[7]], conn.exec("select '7'::varchar").to_ary
+  conn.types.register_encoder("int4", Symbol) { |sym| sym.to_s.size.to_s }
+  assert_equal [[3]], conn.exec("select $1 + 0", :abc).to_ary
+  conn.close
+end
+
+assert("LazyJSON") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  doc = conn.exec(%q{select '{"a": {"b": [1, "x\\u00e9", 2.5, null, true]}, "c\\"d": 1}'::json}).getvalue(0, 0)
+  assert_kind_of Pq::JSON, doc
+  assert_equal "x\u00e9", doc.dig("a", "b", 1)
+  assert_equal 1, doc.dig("a", "b", 0)
+  assert_equal 2.5, doc.dig("a", "b", 2)
+  assert_equal true, doc.dig("a", "b", -1)
+  assert_equal 1, doc.dig("c\"d")
+  assert_kind_of Pq::JSON, doc.dig(:a)
+  assert_nil doc.dig("a", "missing")
+  assert_false doc.parsed?
+  conn.json_mode = :raw
+  assert_equal [[%q{{"a": 1}}]], conn.exec(%q{select '{"a": 1}'::jsonb}).to_ary
+  conn.close
+end
+
+assert("Records") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  records = conn.exec("select 1 as id, 'a' as name, 3 as size").to_records
+  assert_equal 1, records[0].id
+  assert_equal "a", records[0][:name]
+  assert_equal 3, records[0]["size"]
+  assert_equal({id: 1, name: "a", size: 3}, records[0].to_h)
+  assert_equal [:id, :name, :size], records[0].members
+  other = conn.exec("select 2 as id, 'b' as name, 4 as size").to_records
+  assert_same records[0].class, other[0].class
+  assert_not_same records[0].class, conn.exec("select 2::int8 as id").to_records[0].class
+  conn.close
+end
+
+assert("StringViews") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.string_views = 10
+  short, long = conn.exec("select 'short', repeat('x', 100)").to_ary[0]
+  assert_false short.frozen?
+  assert_equal Pq::STRING_VIEWS, long.frozen?
+  assert_equal "x" * 100, long
+  part = long[0, 50]
+  long = nil
+  GC.start
+  assert_equal "x" * 50, part
+  conn.string_views = nil
+  assert_false conn.exec("select repeat('x', 100)").getvalue(0, 0).frozen?
+  conn.close
+end
+
+assert("Bytea") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  bytes = (0..255).map(&:chr).join * 3
+  assert_equal [[bytes]], conn.exec("select $1::bytea", bytes).to_ary
+  conn.exec("set bytea_output = 'escape'")
+  assert_equal [[bytes]], conn.exec("select $1::bytea", bytes).to_ary
+  assert_equal [[["\x01\x02", "\\"]]], conn.exec(%q{select array['\\x0102'::bytea, '\\\\'::bytea]}).to_ary
+  conn.close
+end
+
+assert("DatesAndTimes") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.exec("set timezone = 'Europe/Berlin'")
+  time = Time.at(1704161045, 500000)
+  [Pq::TEXT, Pq::BINARY].each do |format|
+    conn.with_result_format(format) do
+      ts, tz, date, t, interval = conn.exec("select '2024-01-02 02:04:05.5'::timestamp, '2024-01-02 03:04:05.5+01'::timestamptz, '2024-01-02'::date, '03:04:05.5'::time, '-1 year 2 mons -3 days +04:05:06.789'::interval").to_ary[0]
+      assert_equal time, ts
+      assert_true ts.utc?
+      assert_equal time, tz
+      assert_equal Time.utc(2024, 1, 2), date
+      assert_equal 11045500000, t
+      assert_equal [-10, -3, 14706789000], interval
+    end
+  end
+  assert_equal [[true]], conn.exec("select $1 = '2024-01-02 02:04:05.5+00'::timestamptz", time).to_ary
+  conn.time_mode = :usec
+  assert_equal [[1704161045500000, 1704153600000000]], conn.exec("select $1::timestamptz, '2024-01-02'::date", time).to_ary
+  conn.exec("set datestyle = 'German'")
+  assert_equal [["02.01.2024"]], conn.exec("select '2024-01-02'::date").to_ary
+  conn.close
+end
+
+assert("ListenNotify") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.exec("LISTEN test_channel")
+  assert_nil conn.wait_for_notify(0.01)
+  conn.exec("NOTIFY test_channel, 'during exec'")
+  conn.exec("select 1")
+  assert_equal [["test_channel", "during exec"]], conn.notifies.map { |n| n[0, 2] }
+  assert_equal [], conn.notifies
+  other = Pq.new("postgresql://localhost/postgres")
+  other.exec("NOTIFY test_channel, 'a'")
+  other.exec("NOTIFY test_channel, 'b'")
+  payloads = []
+  2.times do
+    assert_equal "test_channel", conn.wait_for_notify(5) { |channel, payload, pid| payloads << [payload, pid] }
+  end
+  pid = other.exec("select pg_backend_pid()").getvalue(0, 0)
+  assert_equal [["a", pid], ["b", pid]], payloads
+  other.close
+  conn.close
+end
+
+assert("ConnectAll") do
+  conns = Pq.connect_all(["postgresql://localhost/postgres"] * 3, timeout: 10)
+  assert_equal 3, conns.size
+  conns.each do |conn|
+    assert_equal Pq::CONNECTION_OK, conn.status
+    assert_equal :ok, conn.connect_poll
+    assert_true conn.types.oid("int4") == 23
+    assert_equal [[1]], conn.exec("select 1::int4").to_ary
+  end
+  conn = conns.first
+  conn.reset_start
+  state = :writing
+  state = conn.reset_poll until state == :ok
+  assert_equal [[2]], conn.exec("select 2::int4").to_ary
+  conns.each(&:close)
+  assert_raise(Pq::ConnectionError, SystemCallError) { Pq.connect_all(["postgresql://localhost:1/postgres"]) }
+end
+
+assert("ConnectStartLoadsTypes") do
+  conn = Pq.connect_start("postgresql://localhost/postgres")
+  state = :writing
+  state = conn.connect_poll until state == :ok
+  # a domain is only decoded like its base type when pg_type was read while connecting
+  assert_equal [[1]], conn.exec("select 1::information_schema.cardinal_number").to_ary
+  conn.close
+end
+
+assert("QueryStats") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  assert_equal({}, conn.stats)
+  conn.collect_stats = true
+  conn.exec("select  generate_series(1, 3)").values
+  conn.exec("select generate_series(1, 5)\n").each_row { |row| row }
+  conn.prepare("stats_stmt", "select $1::int4")
+  conn.exec_prepared("stats_stmt", 1)
+  stats = conn.stats
+  series = stats["select generate_series(?, ?)"]
+  assert_equal 2, series[:calls]
+  assert_equal 8, series[:rows]
+  assert_true series[:bytes] > 0
+  assert_true series[:latency_us][:p50] <= series[:latency_us][:max]
+  assert_equal 1, stats["stats_stmt"][:calls]
+  calls = 0
+  conn.query_stats("select generate_series(?, ?)").histogram.each { |_, count| calls += count }
+  assert_equal 2, calls
+  conn.reset_stats
+  assert_equal({}, conn.stats)
+  conn.collect_stats = false
+  conn.exec("select 1")
+  assert_equal({}, conn.stats)
+  conn.close
+end
+
+assert("Trace") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  assert_equal [], conn.trace_messages
+  conn.trace(limit: 4, attach: 2)
+  10.times { conn.exec("select 1") }
+  messages = conn.trace_messages
+  assert_equal 4, messages.size
+  assert_equal messages.last(2), conn.trace_messages(2)
+  res = conn.exec("i am a syn;tax error")
+  assert_kind_of Pq::Result::FatalError, res
+  assert_equal 2, res.trace.size
+  assert_true res.trace.any? { |line| line.include?("ErrorResponse") }
+  conn.untrace
+  assert_equal [], conn.trace_messages
+  assert_nil conn.exec("i am a syn;tax error").trace
+  conn.close
+end
+
+assert("Timeout") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  assert_raise(Pq::TimeoutError) { conn.exec("select pg_sleep(5)", timeout: 0.1) }
+  assert_equal [[1]], conn.exec("select 1").to_ary
+  assert_raise(Pq::TimeoutError) { conn.exec("select pg_sleep($1)", 5, timeout: 0.1) }
+  statement = conn.prepare("sleep", "select pg_sleep($1)")
+  assert_raise(Pq::TimeoutError) { statement.exec(5, deadline: Time.now + 0.1) }
+  rows = 0
+  assert_raise(Pq::TimeoutError) do
+    conn.stream("select g, pg_sleep(case when g = 3 then 5 else 0 end) from generate_series(1, 5) g", timeout: 0.5) { rows += 1 }
+  end
+  assert_true rows < 3 # only the rows before the slow one, if the server flushed them already
+  assert_equal [[2]], conn.exec("select $1::int", 2, timeout: 5).to_ary
+  assert_equal Pq::TRANS_IDLE, conn.transaction_status
+  assert_raise(ArgumentError) { conn.exec("select 1", timeout: 1, deadline: Time.now) }
+  conn.close
+end
+
+assert("Cursor") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  rows = []
+  conn.cursor("select g from generate_series(1, $1::int) g", 25, batch: 10) { |row| rows << row[0] }
+  assert_equal((1..25).to_a, rows)
+  assert_equal Pq::TRANS_IDLE, conn.transaction_status
+  rows.clear
+  conn.cursor("select g from generate_series(1, 20) g", batch: 10) { |row| rows << row[0] }
+  assert_equal 20, rows.size
+  conn.cursor("select g from generate_series(1, 100) g", batch: 10) { |row| break if row[0] == 15 }
+  assert_equal Pq::TRANS_IDLE, conn.transaction_status
+  conn.exec("begin")
+  assert_raise(RuntimeError) { conn.cursor("select 1", batch: 1) { raise "stop" } }
+  assert_equal Pq::TRANS_INTRANS, conn.transaction_status
+  conn.exec("rollback")
+  assert_raise(Pq::Result::FatalError) { conn.cursor("i am a syn;tax error") { } }
+  assert_equal [[1]], conn.exec("select 1").to_ary
+  conn.close
+end
+
+assert("PoolResetsInBackground") do
+  pool = Pq::Pool.new("postgresql://localhost/postgres", max: 1)
+  conn = pool.checkout
+  pid = conn.exec("select pg_backend_pid()").getvalue(0, 0)
+  other = Pq.new("postgresql://localhost/postgres")
+  other.exec("select pg_terminate_backend($1)", pid)
+  other.close
+  begin
+    conn.exec("select 1")
+  rescue Pq::Error, SystemCallError
+  end
+  assert_equal Pq::CONNECTION_BAD, conn.status
+  pool.checkin(conn)
+  deadline = Time.now + 10
+  checked_out = nil
+  until checked_out || Time.now > deadline
+    begin
+      checked_out = pool.checkout
+    rescue Pq::Pool::ExhaustedError
+    end
+  end
+  assert_same conn, checked_out
+  assert_equal [[1]], checked_out.exec("select 1::int4").to_ary
+  pool.checkin(checked_out)
+  pool.close
+end
+
+assert("TypesLoadedLazily") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  assert_false conn.types.loaded?
+  assert_equal [["1"]], conn.exec("select 1::information_schema.cardinal_number").to_ary
+  assert_equal 23, conn.types.oid("int4")
+  assert_true conn.types.loaded?
+  assert_equal [[1]], conn.exec("select 1::information_schema.cardinal_number").to_ary
+  conn.close
+end
+
+assert("PipelineRaises") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  assert_raise(ArgumentError) do
+    conn.pipeline do |p|
+      p.exec("select 1")
+      p.exec("i am a syn;tax error")
+      raise ArgumentError, "from the block"
+    end
+  end
+  assert_equal Pq::PIPELINE_OFF, conn.pipeline_status
+  assert_equal [[1]], conn.exec("select 1").to_ary
+  conn.close
+end
+
+assert("CopyInAborts") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.exec("create temporary table copy_abort (id int8)")
+  assert_raise(RuntimeError) do
+    conn.copy_in("copy copy_abort from stdin") do |io|
+      io.put("1\n")
+      raise "stop"
+    end
+  end
+  [1, 2].each do |i|
+    conn.copy_in("copy copy_abort from stdin") do |io|
+      io.put("#{i}\n")
+      break
+    end
+  end
+  assert_equal [[0]], conn.exec("select count(*)::int4 from copy_abort").to_ary
+  assert_equal Pq::TRANS_IDLE, conn.transaction_status
+  conn.close
+end
+
+assert("StatementCacheEvictsInFailedTransaction") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.statement_cache = 1
+  count = "select count(*)::int4 from pg_prepared_statements where name like $1"
+  assert_equal [[0]], conn.exec(count, "pq_cached_%").to_ary
+  conn.exec("begin")
+  conn.exec("i am a syn;tax error")
+  # evicts the statement of count while DEALLOCATE can't run
+  assert_kind_of Pq::Result::Error, conn.exec("select $1::int4", 1)
+  conn.exec("rollback")
+  assert_equal [[1]], conn.exec(count, "pq_cached_%").to_ary
+  conn.close
+end
+
+assert("DeclaredParamTypes") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  stmt = conn.prepare("declared_params", "select $1::int2, $2::int4, $3::oid, $4::float8, $5::text")
+  assert_equal [21, 23, 26, 701, 25], stmt.param_types
+  assert_equal [[-32768, 2147483647, 4294967295, 2.0, "1.5"]], stmt.exec(-32768, 2147483647, 4294967295, 2, 1.5).to_ary
+  assert_raise(RangeError) { stmt.exec(32768, 1, 1, 1.0, "a") }
+  assert_raise(RangeError) { stmt.exec(1, -2147483649, 1, 1.0, "a") }
+  assert_raise(RangeError) { stmt.exec(1, 1, -1, 1.0, "a") }
+  assert_raise(TypeError) { stmt.exec(1.5, 1, 1, 1.0, "a") }
+  bool = conn.prepare("declared_bool", "select $1::bool")
+  assert_raise(TypeError) { bool.exec(1) }
+  assert_raise(TypeError) { bool.exec(1.0) }
+  conn.close
+end
+
+assert("RecordIndexesAndClassCache") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  record = conn.exec("select 1 as id, 'a' as name, 3 as size").to_records[0]
+  assert_equal 1, record[0]
+  assert_equal 3, record[-1]
+  assert_nil record[3]
+  assert_equal [1, "a"], record[0, 2]
+  assert_equal ["a", 3], record[1..2]
+  assert_equal "a", record["name"]
+  assert_raise(NameError) { record[:missing] }
+  300.times { |i| conn.exec("select 1 as c#{i}").to_records }
+  assert_equal 256, conn.types.instance_variable_get(:@record_classes).size
+  conn.close
+end
+
+assert("QueryStatsEviction") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.collect_stats = true
+  999.times do |i|
+    conn.exec("select 1 as c#{i}")
+    conn.exec("select 'hot'") if i % 100 == 0
+  end
+  assert_equal 1000, conn.stats.size
+  assert_not_nil conn.query_stats("select ? as c0")
+  conn.exec("select 1 as c999")
+  assert_equal 1000, conn.stats.size
+  assert_nil conn.query_stats("select ? as c0")
+  assert_equal 10, conn.query_stats("select ?").to_h[:calls]
+  conn.close
+end
+
+assert("StringViewsOutliveResult") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.string_views = true
+  res = conn.exec("select repeat('a', 1000), repeat('b', 1000) from generate_series(1, 100)")
+  views = res.values.map { |row| row[1] }
+  substring = views[99][10, 20]
+  res = nil
+  conn.close
+  conn = nil
+  GC.start
+  # garbage which would reuse the memory of the result if it had been freed
+  1000.times { "c" * 1000 }
+  GC.start
+  assert_equal ["b" * 1000] * 100, views
+  assert_equal "b" * 20, substring
+  views = nil
+  GC.start
+  assert_equal "b" * 20, substring
+end
+
+assert("DeclaredTimeParamTypes") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  stmt = conn.prepare("declared_time", "select $1::text, $2::time, $3::date, $4::timestamptz")
+  assert_equal [25, 1083, 1082, 1184], stmt.param_types
+  time = Time.at(1704161045, 500000)
+  text, t, date, tz = stmt.exec(time, time, time, time).to_ary[0]
+  assert_equal "2024-01-02 02:04:05.500000+00", text
+  assert_equal 7445500000, t
+  assert_equal Time.utc(2024, 1, 2), date
+  assert_equal time, tz
+  conn.close
+end
+
+assert("CopyInColumnTypes") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.exec("create temporary table copy_types (a int2, b int4, c float4, d date, e timestamp, f int4[], g text)")
+  time = Time.at(1704161045, 500000)
+  conn.copy_in("copy copy_types from stdin with (format binary)", types: ["int2", "int4", "float4", "date", "timestamp", "_int4", 25]) do |io|
+    io.put_row(1, 2, 1.5, time, time, [1, nil, 3], 4)
+    io.put_row(nil, nil, nil, nil, nil, nil, nil)
+    assert_raise(ArgumentError) { io.put_row(1) }
+    assert_raise(TypeError) { io.put_row(1, 2, 1.5, time, time, [1], true) }
+    assert_raise(RangeError) { io.put_row(40000, 2, 1.5, time, time, [1], "a") }
+  end
+  assert_equal [[1, 2, 1.5, Time.utc(2024, 1, 2), time, [1, :NULL, 3], "4"], [:NULL] * 7], conn.exec("select * from copy_types order by a nulls last").to_ary
+  assert_raise(TypeError) do
+    conn.copy_in("copy copy_types (a) from stdin with (format binary)", types: ["int2"]) { |io| io.put_row(1.5) }
+  end
+  assert_equal Pq::TRANS_IDLE, conn.transaction_status
+  conn.close
+end
+
+assert("ParamTypesAfterFailedDescribe") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  stmt = conn.prepare("param_types_retry", "select $1::int4")
+  conn.exec("begin")
+  conn.exec("i am a syn;tax error")
+  assert_equal [], stmt.param_types
+  conn.exec("rollback")
+  assert_equal [23], stmt.param_types
+  assert_equal [[1]], stmt.exec(1).to_ary
+  conn.close
+end
+
+assert("StatementCacheReplacedInFailedTransaction") do
+  conn = Pq.new("postgresql://localhost/postgres")
+  conn.statement_cache = 4
+  conn.exec("select $1::int4", 1)
+  conn.exec("begin")
+  conn.exec("i am a syn;tax error")
+  assert_raise(Pq::Error) { conn.statement_cache = nil }
+  assert_equal 1, conn.statement_cache.size
+  conn.exec("rollback")
+  conn.statement_cache = nil
+  assert_equal [[0]], conn.exec("select count(*)::int4 from pg_prepared_statements").to_ary
+  conn.close
+end